@@ -0,0 +1,302 @@
+#include <dlfcn.h>
+#include <math.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "aot.h"
+#include "cache.h"
+#include "compiler.h"
+
+extern char** environ;
+
+#define ENTRIES_SYMBOL "clox_aot_entries"
+#define COUNT_SYMBOL "clox_aot_count"
+
+/**
+ * Writes a number as a C expression with exactly its bits. Hexadecimal float literals are exact
+ * for every finite number, -0 included; infinities and NaNs are built from their bits.
+ * @param out the C file
+ * @param number the number
+ */
+static void emitNumber(FILE* out, double number) {
+    if(isfinite(number)) {
+        fprintf(out, "%a", number);
+        return;
+    }
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    fprintf(out, "fromBits(0x%016llxULL)", (unsigned long long)bits);
+}
+
+static bool emitConstant(FILE* out, Chunk* chunk, int slot, int constant) {
+    Value value = chunk->constants.values[constant];
+    if(!IS_NUMBER(value)) return false;
+    fprintf(out, "    s%d = ", slot);
+    emitNumber(out, AS_NUMBER(value));
+    fprintf(out, ";\n");
+    return true;
+}
+
+static char cOperator(uint8_t op) {
+    switch(op) {
+        case OP_ADD:
+        case OP_ADD_CONSTANT: return '+';
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_CONSTANT: return '-';
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_CONSTANT: return '*';
+        default: return '/';
+    }
+}
+
+/**
+ * Translates a chunk into a C function of straight-line code. Every stack slot becomes a local
+ * variable and every instruction one assignment doing the same double arithmetic as the VM, so
+ * that a C compiler which keeps to IEEE 754 computes the same results.
+ * @param out the C file
+ * @param chunk the chunk to translate
+ * @param name the name of the function
+ * @param usesParams set when the code reads parameters
+ * @return false if the chunk has something which cannot be translated
+ */
+static bool emitFunction(FILE* out, Chunk* chunk, const char* name, bool* usesParams) {
+    fprintf(out, "static double %s(const double* params) {\n", name);
+    for(int slot = 0; slot < chunk->maxStack; slot++) {
+        fprintf(out, slot % 16 == 0 ? "    double s%d" : ", s%d", slot);
+        if(slot % 16 == 15 || slot == chunk->maxStack - 1) fprintf(out, ";\n");
+    }
+
+    uint8_t* code = chunk->code;
+    int top = 0;
+    for(int offset = 0; offset < chunk->count;) {
+        uint8_t op = code[offset];
+        switch(op) {
+            case OP_CONSTANT:
+                if(!emitConstant(out, chunk, top++, code[offset + 1])) return false;
+                offset += 2;
+                break;
+            case OP_CONSTANT_LONG:
+                if(!emitConstant(out, chunk, top++,
+                                 code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16))) {
+                    return false;
+                }
+                offset += 4;
+                break;
+            case OP_CONSTANT_CONSTANT:
+                if(!emitConstant(out, chunk, top++, code[offset + 1])) return false;
+                if(!emitConstant(out, chunk, top++, code[offset + 2])) return false;
+                offset += 3;
+                break;
+            case OP_GET_PARAM:
+                *usesParams = true;
+                fprintf(out, "    s%d = params[%d];\n", top++, code[offset + 1]);
+                offset += 2;
+                break;
+            case OP_GET_LOCAL:
+                fprintf(out, "    s%d = s%d;\n", top, code[offset + 1]);
+                top++;
+                offset += 2;
+                break;
+            case OP_NEGATE:
+                fprintf(out, "    s%d = -s%d;\n", top - 1, top - 1);
+                offset += 1;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                fprintf(out, "    s%d = s%d %c s%d;\n", top - 2, top - 2, cOperator(op), top - 1);
+                top--;
+                offset += 1;
+                break;
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT: {
+                Value constant = chunk->constants.values[code[offset + 1]];
+                if(!IS_NUMBER(constant)) return false;
+                fprintf(out, "    s%d = s%d %c ", top - 1, top - 1, cOperator(op));
+                emitNumber(out, AS_NUMBER(constant));
+                fprintf(out, ";\n");
+                offset += 2;
+                break;
+            }
+            case OP_RETURN:
+                fprintf(out, "    return s%d;\n}\n\n", top - 1);
+                return true;
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * Writes source text as a C string literal. Everything but plain printable characters is escaped
+ * in octal, and so is '?' so that no trigraph can form.
+ */
+static void emitString(FILE* out, const char* text, size_t length) {
+    fputc('"', out);
+    for(size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if(c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?') {
+            fputc(c, out);
+        } else {
+            fprintf(out, "\\%03o", c);
+        }
+        if(c == '\n') fprintf(out, "\"\n    \"");
+    }
+    fputc('"', out);
+}
+
+/**
+ * Compiles expressions and writes them out as a C file which builds into an AOT library: one
+ * function per expression and a table which finds each function by its source text.
+ * @param out the C file
+ * @param sources the NUL terminated source text of every expression
+ * @param count the number of expressions
+ * @param params the names of the parameters the expressions may use
+ * @param paramCount the number of parameters
+ * @return false if an expression does not compile or cannot be translated
+ */
+bool emitLibrary(FILE* out, const char* const sources[], int count, const char* const params[], int paramCount) {
+    bool* usesParams = calloc(count > 0 ? count : 1, sizeof(bool));
+    fprintf(out, "// Generated by clox --emit-c. Build without -ffast-math and with -ffp-contract=off, as\n"
+                 "// results only match the VM when every operation is rounded on its own.\n"
+                 "#include <stddef.h>\n#include <stdint.h>\n\n"
+                 "#pragma STDC FP_CONTRACT OFF\n\n"
+                 "typedef struct {\n    const char* source;\n    size_t length;\n    uint64_t hash;\n"
+                 "    int usesParams;\n    double (*function)(const double* params);\n} AotEntry;\n\n"
+                 "static inline double fromBits(uint64_t bits) {\n"
+                 "    union { uint64_t bits; double number; } value = {bits};\n    return value.number;\n}\n\n");
+
+    bool ok = true;
+    for(int i = 0; i < count && ok; i++) {
+        Chunk chunk;
+        initChunk(&chunk);
+        char name[32];
+        snprintf(name, sizeof(name), "expression%d", i);
+        ok = compileWithParams(sources[i], &chunk, params, paramCount) &&
+             emitFunction(out, &chunk, name, &usesParams[i]);
+        if(!ok) fprintf(stderr, "Expression %d cannot be compiled ahead of time.\n", i);
+        freeChunk(&chunk);
+    }
+
+    if(ok) {
+        fprintf(out, "const AotEntry " ENTRIES_SYMBOL "[] = {\n");
+        for(int i = 0; i < count; i++) {
+            size_t length = strlen(sources[i]);
+            fprintf(out, "    {");
+            emitString(out, sources[i], length);
+            fprintf(out, ",\n     %zu, 0x%016llxULL, %d, expression%d},\n", length,
+                    (unsigned long long)hashSource(sources[i], length), usesParams[i] ? 1 : 0, i);
+        }
+        // An empty initializer list is not C, so an empty library gets one entry nothing can match.
+        if(count == 0) fprintf(out, "    {\"\", 1, 0, 0, NULL},\n");
+        fprintf(out, "};\nconst int " COUNT_SYMBOL " = %d;\n", count);
+    }
+    free(usesParams);
+    return ok;
+}
+
+/**
+ * Builds a C file written by emitLibrary() into a shared object with the system C compiler, or the
+ * one named by $CC.
+ * @param cPath the C file
+ * @param libraryPath the shared object to write
+ * @return true if the compiler succeeded
+ */
+bool buildLibrary(const char* cPath, const char* libraryPath) {
+    const char* cc = getenv("CC");
+    if(cc == NULL || cc[0] == '\0') cc = "cc";
+    char* const argv[] = {(char*)cc, "-O2", "-ffp-contract=off", "-fPIC", "-shared", "-o", (char*)libraryPath,
+                          (char*)cPath, NULL};
+
+    pid_t pid;
+    if(posix_spawnp(&pid, cc, NULL, NULL, argv, environ) != 0) {
+        fprintf(stderr, "Could not run the C compiler \"%s\".\n", cc);
+        return false;
+    }
+    int status;
+    if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "The C compiler failed to build \"%s\".\n", libraryPath);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Finds the slot of the table which holds the index of an expression, or the empty slot where it
+ * would go. Like the constant table of a chunk it stores index + 1 so that 0 marks an empty slot.
+ */
+static int findSlot(AotLibrary* library, const char* source, size_t length, uint64_t hash) {
+    int mask = library->slotCapacity - 1;
+    int slot = (int)(hash & (uint64_t)mask);
+    for(;;) {
+        int entry = library->slots[slot];
+        if(entry == 0) return slot;
+        const AotEntry* candidate = &library->entries[entry - 1];
+        if(candidate->hash == hash && candidate->length == length &&
+           memcmp(candidate->source, source, length) == 0) {
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+/**
+ * Loads an AOT library and indexes its expressions.
+ * @param library the library to fill in
+ * @param path the path of the shared object
+ * @return false if it could not be loaded or is not an AOT library
+ */
+bool loadLibrary(AotLibrary* library, const char* path) {
+    // dlopen only searches the library path for names without a slash.
+    char* resolved = strchr(path, '/') == NULL ? malloc(strlen(path) + 3) : NULL;
+    if(resolved != NULL) sprintf(resolved, "./%s", path);
+    library->handle = dlopen(resolved != NULL ? resolved : path, RTLD_NOW | RTLD_LOCAL);
+    free(resolved);
+    if(library->handle == NULL) {
+        fprintf(stderr, "Could not load \"%s\": %s\n", path, dlerror());
+        return false;
+    }
+
+    library->entries = (const AotEntry*)dlsym(library->handle, ENTRIES_SYMBOL);
+    const int* count = (const int*)dlsym(library->handle, COUNT_SYMBOL);
+    if(library->entries == NULL || count == NULL) {
+        fprintf(stderr, "\"%s\" is not a clox library.\n", path);
+        dlclose(library->handle);
+        return false;
+    }
+    library->count = *count;
+
+    library->slotCapacity = 8;
+    while(library->slotCapacity < library->count * 2) library->slotCapacity *= 2;
+    library->slots = GROW_ARRAY(&heapAllocator, MEMORY_VM, int, NULL, 0, library->slotCapacity);
+    memset(library->slots, 0, sizeof(int) * library->slotCapacity);
+    for(int i = 0; i < library->count; i++) {
+        const AotEntry* entry = &library->entries[i];
+        int slot = findSlot(library, entry->source, entry->length, entry->hash);
+        if(library->slots[slot] == 0) library->slots[slot] = i + 1;
+    }
+    return true;
+}
+
+void freeLibrary(AotLibrary* library) {
+    FREE_ARRAY(&heapAllocator, MEMORY_VM, int, library->slots, library->slotCapacity);
+    dlclose(library->handle);
+}
+
+/**
+ * Looks up the compiled function of an expression.
+ * @param library the library
+ * @param source the source text of the expression
+ * @param length the length of the source text
+ * @return the expression, or NULL if it is not in the library
+ */
+const AotEntry* findExpression(AotLibrary* library, const char* source, size_t length) {
+    int entry = library->slots[findSlot(library, source, length, hashSource(source, length))];
+    return entry != 0 ? &library->entries[entry - 1] : NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+typedef double (*AotFunction)(const double* params);
+
+/*
+ * An expression compiled ahead of time. A library written by emitLibrary() exports a table of
+ * these, which is why the generated C declares the same struct.
+ */
+typedef struct {
+    const char* source;
+    size_t length;
+    uint64_t hash;
+    int usesParams;
+    AotFunction function;
+} AotEntry;
+
+/*
+ * A shared object of compiled expressions, loaded with dlopen. Expressions are found by their
+ * source text through a hash table built when the library is loaded.
+ */
+typedef struct {
+    void* handle;
+    const AotEntry* entries;
+    int count;
+    int* slots;
+    int slotCapacity;
+} AotLibrary;
+
+bool emitLibrary(FILE* out, const char* const sources[], int count, const char* const params[], int paramCount);
+bool buildLibrary(const char* cPath, const char* libraryPath);
+bool loadLibrary(AotLibrary* library, const char* path);
+void freeLibrary(AotLibrary* library);
+const AotEntry* findExpression(AotLibrary* library, const char* source, size_t length);
+
+#endif //CLOX_AOT_H
@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "compiler.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BATCH_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*BinaryKernel)(double* out, const double* a, const double* b, int count);
+typedef void (*ScalarKernel)(double* out, const double* a, double b, int count);
+typedef void (*UnaryKernel)(double* out, const double* a, int count);
+
+typedef enum {
+    KERNEL_ADD,
+    KERNEL_SUBTRACT,
+    KERNEL_MULTIPLY,
+    KERNEL_DIVIDE,
+} KernelOp;
+
+/*
+ * One implementation of every opcode over a block of rows. The binary kernels come in three forms:
+ * column op column, column op scalar and scalar op column, the scalar being a constant or a value
+ * folded from constants.
+ */
+struct BatchKernels {
+    const char* name;
+    BinaryKernel columnColumn[4];
+    ScalarKernel columnScalar[4];
+    ScalarKernel scalarColumn[4];
+    UnaryKernel negate;
+};
+
+#define PORTABLE_BINARY(name, op) \
+    static void name##Portable(double* out, const double* a, const double* b, int count) { \
+        for(int i = 0; i < count; i++) out[i] = a[i] op b[i]; \
+    } \
+    static void name##PortableCS(double* out, const double* a, double b, int count) { \
+        for(int i = 0; i < count; i++) out[i] = a[i] op b; \
+    } \
+    static void name##PortableSC(double* out, const double* a, double b, int count) { \
+        for(int i = 0; i < count; i++) out[i] = b op a[i]; \
+    }
+
+PORTABLE_BINARY(add, +)
+PORTABLE_BINARY(subtract, -)
+PORTABLE_BINARY(multiply, *)
+PORTABLE_BINARY(divide, /)
+
+static void negatePortable(double* out, const double* a, int count) {
+    for(int i = 0; i < count; i++) out[i] = -a[i];
+}
+
+static const BatchKernels portableKernels = {
+        "portable",
+        {addPortable, subtractPortable, multiplyPortable, dividePortable},
+        {addPortableCS, subtractPortableCS, multiplyPortableCS, dividePortableCS},
+        {addPortableSC, subtractPortableSC, multiplyPortableSC, dividePortableSC},
+        negatePortable,
+};
+
+#ifdef BATCH_X86
+/*
+ * The vector loop handles whole vectors with unaligned loads, since columns come straight from the
+ * caller, and the scalar loop after it handles the tail. Both round the same way, so results do
+ * not depend on which kernel set was picked.
+ */
+#define VECTOR_BINARY(name, isa, feature, vector, width, load, store, broadcast, intrinsic, op) \
+    __attribute__((target(feature))) \
+    static void name##isa(double* out, const double* a, const double* b, int count) { \
+        int i = 0; \
+        for(; i + width <= count; i += width) store(out + i, intrinsic(load(a + i), load(b + i))); \
+        for(; i < count; i++) out[i] = a[i] op b[i]; \
+    } \
+    __attribute__((target(feature))) \
+    static void name##isa##CS(double* out, const double* a, double b, int count) { \
+        vector scalar = broadcast(b); \
+        int i = 0; \
+        for(; i + width <= count; i += width) store(out + i, intrinsic(load(a + i), scalar)); \
+        for(; i < count; i++) out[i] = a[i] op b; \
+    } \
+    __attribute__((target(feature))) \
+    static void name##isa##SC(double* out, const double* a, double b, int count) { \
+        vector scalar = broadcast(b); \
+        int i = 0; \
+        for(; i + width <= count; i += width) store(out + i, intrinsic(scalar, load(a + i))); \
+        for(; i < count; i++) out[i] = b op a[i]; \
+    }
+
+#define VECTOR_KERNELS(isa, feature, vector, width, load, store, broadcast, vadd, vsub, vmul, vdiv, vxor) \
+    VECTOR_BINARY(add, isa, feature, vector, width, load, store, broadcast, vadd, +) \
+    VECTOR_BINARY(subtract, isa, feature, vector, width, load, store, broadcast, vsub, -) \
+    VECTOR_BINARY(multiply, isa, feature, vector, width, load, store, broadcast, vmul, *) \
+    VECTOR_BINARY(divide, isa, feature, vector, width, load, store, broadcast, vdiv, /) \
+    __attribute__((target(feature))) \
+    static void negate##isa(double* out, const double* a, int count) { \
+        vector sign = broadcast(-0.0); \
+        int i = 0; \
+        for(; i + width <= count; i += width) store(out + i, vxor(load(a + i), sign)); \
+        for(; i < count; i++) out[i] = -a[i]; \
+    } \
+    static const BatchKernels isa##Kernels = { \
+            #isa, \
+            {add##isa, subtract##isa, multiply##isa, divide##isa}, \
+            {add##isa##CS, subtract##isa##CS, multiply##isa##CS, divide##isa##CS}, \
+            {add##isa##SC, subtract##isa##SC, multiply##isa##SC, divide##isa##SC}, \
+            negate##isa, \
+    };
+
+VECTOR_KERNELS(sse2, "sse2", __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd,
+               _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_div_pd, _mm_xor_pd)
+VECTOR_KERNELS(avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd,
+               _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd, _mm256_xor_pd)
+#endif
+
+/**
+ * Picks the widest kernel set the CPU supports. CLOX_BATCH_KERNELS can name a narrower set
+ * (portable, sse2 or avx2) to compare them; a set the CPU lacks is never picked.
+ * @return the kernels to evaluate with
+ */
+static const BatchKernels* selectKernels(void) {
+    const char* requested = getenv("CLOX_BATCH_KERNELS");
+    if(requested != NULL && strcmp(requested, "portable") == 0) return &portableKernels;
+#ifdef BATCH_X86
+    __builtin_cpu_init();
+    bool wantAvx2 = requested == NULL || strcmp(requested, "avx2") == 0;
+    if(wantAvx2 && __builtin_cpu_supports("avx2")) return &avx2Kernels;
+    if(__builtin_cpu_supports("sse2")) return &sse2Kernels;
+#endif
+    return &portableKernels;
+}
+
+/**
+ * Checks that the chunk only uses the opcodes batch evaluation understands. How deep its stack
+ * gets is already known from the compiler.
+ * @param chunk the compiled expression
+ * @return false if an opcode is not supported
+ */
+static bool batchSupported(Chunk* chunk) {
+    for(int offset = 0; offset < chunk->count;) {
+        switch(chunk->code[offset]) {
+            case OP_CONSTANT:
+            case OP_GET_PARAM: offset += 2; break;
+            case OP_CONSTANT_LONG: offset += 4; break;
+            case OP_CONSTANT_CONSTANT: offset += 3; break;
+            case OP_NEGATE:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_RETURN: offset += 1; break;
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT: offset += 2; break;
+            default: return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Compiles an expression over named parameters once so that it can be evaluated over any number
+ * of rows afterwards.
+ * @param expression the expression to initialise
+ * @param source the NUL terminated source of a single arithmetic expression
+ * @param params the parameter names, the i-th name reads the i-th column
+ * @param paramCount the number of parameters
+ * @return false if there was a compile error, in which case there is nothing to free
+ */
+bool compileBatch(BatchExpression* expression, const char* source,
+                  const char* const params[], int paramCount) {
+    initChunk(&expression->chunk);
+    expression->paramCount = paramCount;
+
+    if(!compileWithParams(source, &expression->chunk, params, paramCount)) {
+        freeChunk(&expression->chunk);
+        return false;
+    }
+
+    if(!batchSupported(&expression->chunk)) {
+        fprintf(stderr, "Error: Expression cannot be evaluated in batches.\n");
+        freeChunk(&expression->chunk);
+        return false;
+    }
+
+    expression->kernels = selectKernels();
+    return true;
+}
+
+/*
+ * A value on the column stack: either a column of the current block or, for constants and values
+ * computed only from constants, a single scalar standing for every row.
+ */
+typedef struct {
+    const double* column;
+    double scalar;
+} Operand;
+
+/**
+ * Runs one block of rows through the chunk, one opcode at a time over the whole block.
+ * @param expression the compiled expression
+ * @param columns the parameter columns, already offset to the first row of the block
+ * @param count the number of rows in the block
+ * @param scratch a column of BATCH_BLOCK doubles for each stack slot
+ * @param stack an operand for each stack slot
+ * @param out where the results of the block go
+ */
+static void evaluateBlock(BatchExpression* expression, const double* const columns[], int count,
+                          double* scratch, Operand* stack, double* out) {
+    const BatchKernels* kernels = expression->kernels;
+    Chunk* chunk = &expression->chunk;
+    Value* constants = chunk->constants.values;
+    Operand* top = stack;
+    uint8_t* ip = chunk->code;
+
+    for(;;) {
+        uint8_t instruction = *ip++;
+        KernelOp op;
+        double constant;
+        switch(instruction) {
+            case OP_CONSTANT:
+                *top++ = (Operand){NULL, AS_NUMBER(constants[*ip++])};
+                continue;
+            case OP_CONSTANT_LONG:
+                *top++ = (Operand){NULL, AS_NUMBER(constants[ip[0] | (ip[1] << 8) | (ip[2] << 16)])};
+                ip += 3;
+                continue;
+            case OP_CONSTANT_CONSTANT:
+                *top++ = (Operand){NULL, AS_NUMBER(constants[ip[0]])};
+                *top++ = (Operand){NULL, AS_NUMBER(constants[ip[1]])};
+                ip += 2;
+                continue;
+            case OP_GET_PARAM:
+                *top++ = (Operand){columns[*ip++], 0};
+                continue;
+            case OP_RETURN: {
+                Operand* result = &top[-1];
+                if(result->column == NULL) {
+                    for(int i = 0; i < count; i++) out[i] = result->scalar;
+                } else if(result->column != out) {
+                    memcpy(out, result->column, sizeof(double) * count);
+                }
+                return;
+            }
+            case OP_NEGATE: {
+                Operand* operand = &top[-1];
+                if(operand->column == NULL) {
+                    operand->scalar = -operand->scalar;
+                    continue;
+                }
+                double* target = *ip == OP_RETURN ? out : scratch + (top - 1 - stack) * BATCH_BLOCK;
+                kernels->negate(target, operand->column, count);
+                operand->column = target;
+                continue;
+            }
+            case OP_ADD: op = KERNEL_ADD; break;
+            case OP_SUBTRACT: op = KERNEL_SUBTRACT; break;
+            case OP_MULTIPLY: op = KERNEL_MULTIPLY; break;
+            case OP_DIVIDE: op = KERNEL_DIVIDE; break;
+            case OP_ADD_CONSTANT: op = KERNEL_ADD; break;
+            case OP_SUBTRACT_CONSTANT: op = KERNEL_SUBTRACT; break;
+            case OP_MULTIPLY_CONSTANT: op = KERNEL_MULTIPLY; break;
+            case OP_DIVIDE_CONSTANT: op = KERNEL_DIVIDE; break;
+            default:
+                return;
+        }
+
+        // Binary operators: the fused forms take their right operand from the constant pool.
+        Operand right;
+        if(instruction >= OP_ADD_CONSTANT) {
+            constant = AS_NUMBER(constants[*ip++]);
+            right = (Operand){NULL, constant};
+        } else {
+            right = *--top;
+        }
+        Operand* left = &top[-1];
+        double* target = *ip == OP_RETURN ? out : scratch + (top - 1 - stack) * BATCH_BLOCK;
+
+        if(left->column == NULL && right.column == NULL) {
+            double a = left->scalar;
+            double b = right.scalar;
+            switch(op) {
+                case KERNEL_ADD: left->scalar = a + b; break;
+                case KERNEL_SUBTRACT: left->scalar = a - b; break;
+                case KERNEL_MULTIPLY: left->scalar = a * b; break;
+                case KERNEL_DIVIDE: left->scalar = a / b; break;
+            }
+            continue;
+        }
+
+        if(right.column == NULL) {
+            kernels->columnScalar[op](target, left->column, right.scalar, count);
+        } else if(left->column == NULL) {
+            kernels->scalarColumn[op](target, right.column, left->scalar, count);
+        } else {
+            kernels->columnColumn[op](target, left->column, right.column, count);
+        }
+        left->column = target;
+    }
+}
+
+/**
+ * Evaluates a compiled expression for every row. Rows are processed in blocks of BATCH_BLOCK:
+ * each opcode runs as a vector kernel over the whole block before the next opcode starts, so the
+ * dispatch cost is paid once per block instead of once per row.
+ * @param expression the compiled expression
+ * @param columns one array of rows doubles for each parameter, in the order the names were given
+ * @param rows the number of rows
+ * @param out receives the result of every row, it may not overlap the columns
+ * @return false if there was no memory for the scratch columns or the operand stack, in which case
+ * out is left untouched
+ */
+bool evaluateBatch(BatchExpression* expression, const double* const columns[], size_t rows, double* out) {
+    size_t slots = (size_t)expression->chunk.maxStack + 1;
+    double* scratch = aligned_alloc(32, sizeof(double) * BATCH_BLOCK * slots);
+    Operand* stack = malloc(sizeof(Operand) * slots);
+    if(scratch == NULL || stack == NULL) {
+        free(scratch);
+        free(stack);
+        return false;
+    }
+    const double* blockColumns[PARAM_MAX];
+
+    for(size_t row = 0; row < rows; row += BATCH_BLOCK) {
+        int count = rows - row < BATCH_BLOCK ? (int)(rows - row) : BATCH_BLOCK;
+        for(int i = 0; i < expression->paramCount; i++) {
+            blockColumns[i] = columns[i] + row;
+        }
+        evaluateBlock(expression, blockColumns, count, scratch, stack, out + row);
+    }
+
+    free(stack);
+    free(scratch);
+    return true;
+}
+
+/**
+ * @param expression a compiled expression
+ * @return the name of the kernel set the expression is evaluated with
+ */
+const char* batchKernelName(BatchExpression* expression) {
+    return expression->kernels->name;
+}
+
+void freeBatch(BatchExpression* expression) {
+    freeChunk(&expression->chunk);
+}
@@ -0,0 +1,23 @@
+#ifndef CLOX_BATCH_H
+#define CLOX_BATCH_H
+
+#include "chunk.h"
+
+// Rows evaluated per pass over the chunk. Every stack slot gets a scratch column of this size.
+#define BATCH_BLOCK 512
+
+typedef struct BatchKernels BatchKernels;
+
+typedef struct {
+    Chunk chunk;
+    int paramCount;
+    const BatchKernels* kernels;
+} BatchExpression;
+
+bool compileBatch(BatchExpression* expression, const char* source,
+                  const char* const params[], int paramCount);
+bool evaluateBatch(BatchExpression* expression, const double* const columns[], size_t rows, double* out);
+const char* batchKernelName(BatchExpression* expression);
+void freeBatch(BatchExpression* expression);
+
+#endif //CLOX_BATCH_H
@@ -0,0 +1,1040 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aot.h"
+#include "compiler.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "runner.h"
+#include "scanner.h"
+#include "vm.h"
+
+#define BENCH_SAMPLES 5
+#define BENCH_REPEATS 3
+#define MAX_REPEATS 15
+// A metric regresses when it is worse than the baseline by more than SPREAD_FACTOR times its spread
+// between repeats, but at least MIN_THRESHOLD percent. DEFAULT_THRESHOLD is used when no spread is known.
+#define SPREAD_FACTOR 2.0
+#define MIN_THRESHOLD 5.0
+#define DEFAULT_THRESHOLD 10.0
+#define BENCH_SEED 0x2545f4914f6cdd1dULL
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+typedef struct {
+    const char* name;
+    void (*generate)(Buffer* buffer, int size);
+    int size;
+    int quickSize;
+} Workload;
+
+#define MAX_MEASUREMENTS 12
+
+/*
+ * One number a benchmark reports. Sizes are only informational; timings and rates are compared
+ * against a baseline. With the benchmarks repeated, value is the median over the repeats and spread
+ * how far apart the fastest and slowest repeat were, in percent of it.
+ */
+typedef struct {
+    const char* field;
+    double value;
+    double spread;
+    bool compared;
+    bool higherIsBetter;
+} Measurement;
+
+typedef struct {
+    const char* name;
+    int count;
+    Measurement measurements[MAX_MEASUREMENTS];
+} BenchResult;
+
+static const char* const paramNames[] = {"x", "y", "z"};
+static const double paramValues[] = {1.5, -2.25, 3.0};
+#define PARAM_COUNT 3
+
+static uint64_t randomState;
+
+/**
+ * xorshift64*, so that every run of the benchmark generates exactly the same sources.
+ * @param bound one more than the largest number wanted
+ * @return a pseudo random number below bound
+ */
+static uint32_t nextRandom(uint32_t bound) {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (uint32_t)((randomState * 0x2545f4914f6cdd1dULL) >> 32) % bound;
+}
+
+static void append(Buffer* buffer, const char* format, ...) {
+    for(;;) {
+        va_list args;
+        va_start(args, format);
+        size_t room = buffer->capacity - buffer->length;
+        int written = vsnprintf(buffer->data + buffer->length, room, format, args);
+        va_end(args);
+        if(written >= 0 && (size_t)written < room) {
+            buffer->length += written;
+            return;
+        }
+        buffer->capacity = buffer->capacity * 2 + written + 1;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+}
+
+static void appendOperand(Buffer* buffer) {
+    switch(nextRandom(4)) {
+        case 0: append(buffer, "%d", nextRandom(1000)); break;
+        case 1: append(buffer, "%d.%d", nextRandom(100), nextRandom(100)); break;
+        default: append(buffer, "%s", paramNames[nextRandom(PARAM_COUNT)]); break;
+    }
+}
+
+static void appendOperator(Buffer* buffer) {
+    static const char* const operators[] = {" + ", " - ", " * ", " / "};
+    append(buffer, "%s", operators[nextRandom(4)]);
+}
+
+/**
+ * A complete binary tree of parenthesised operations. Most leaves are parameters, so folding
+ * leaves nearly all of the tree for the VM.
+ */
+static void generateTree(Buffer* buffer, int depth) {
+    if(depth == 0) {
+        appendOperand(buffer);
+        return;
+    }
+    append(buffer, "(");
+    generateTree(buffer, depth - 1);
+    appendOperator(buffer);
+    generateTree(buffer, depth - 1);
+    append(buffer, ")");
+}
+
+/**
+ * One long left-associative chain of binary operators, which keeps the stack shallow.
+ */
+static void generateChain(Buffer* buffer, int terms) {
+    appendOperand(buffer);
+    for(int i = 1; i < terms; i++) {
+        appendOperator(buffer);
+        if(i % 16 == 0) append(buffer, "\n");
+        appendOperand(buffer);
+    }
+}
+
+/**
+ * An operator chain laid out like generated code: indented lines with a comment after each term.
+ */
+static void generateCommented(Buffer* buffer, int terms) {
+    for(int i = 0; i < terms; i++) {
+        append(buffer, i == 0 ? "        " : "        + ");
+        appendOperand(buffer);
+        append(buffer, "    // term %d of the generated sum, kept for traceability\n", i);
+    }
+}
+
+/**
+ * A sum of numeric literals in a mix of forms. It folds down to a single constant, so it measures
+ * the scanner and the compiler rather than the VM.
+ */
+static void generateLiterals(Buffer* buffer, int count) {
+    for(int i = 0; i < count; i++) {
+        if(i > 0) append(buffer, i % 8 == 0 ? " +\n" : " + ");
+        switch(nextRandom(3)) {
+            case 0: append(buffer, "%u", nextRandom(1000000)); break;
+            case 1: append(buffer, "%u.%u", nextRandom(10000), nextRandom(1000000)); break;
+            default: append(buffer, "0.%06u", nextRandom(1000000)); break;
+        }
+    }
+}
+
+static const Workload workloads[] = {
+        {"deep_tree",       generateTree,     16,     12},
+        {"operator_chain",  generateChain,    200000, 20000},
+        {"numeric_literals", generateLiterals, 200000, 20000},
+        {"commented_chain", generateCommented, 100000, 10000},
+};
+
+// One result per workload and one for each of the other benchmarks.
+#define MAX_RESULTS (sizeof(workloads) / sizeof(workloads[0]) + 4)
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double median(double* samples) {
+    qsort(samples, BENCH_SAMPLES, sizeof(double), compareDoubles);
+    return samples[BENCH_SAMPLES / 2];
+}
+
+static void size(BenchResult* result, const char* field, double value) {
+    result->measurements[result->count++] = (Measurement){field, value, 0, false, false};
+}
+
+static void cost(BenchResult* result, const char* field, double value) {
+    result->measurements[result->count++] = (Measurement){field, value, 0, true, false};
+}
+
+static void rate(BenchResult* result, const char* field, double value) {
+    result->measurements[result->count++] = (Measurement){field, value, 0, true, true};
+}
+
+/**
+ * Counts the instructions in a chunk. Expressions have no jumps, so this is also the number of
+ * instructions one run executes.
+ */
+static long countOpcodes(Chunk* chunk) {
+    long count = 0;
+    for(int offset = 0; offset < chunk->count; count++) {
+        switch(chunk->code[offset]) {
+            case OP_CONSTANT_LONG: offset += 4; break;
+            case OP_CONSTANT_CONSTANT: offset += 3; break;
+            case OP_CONSTANT:
+            case OP_GET_PARAM:
+            case OP_GET_LOCAL:
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT: offset += 2; break;
+            default: offset += 1; break;
+        }
+    }
+    return count;
+}
+
+static long scanAll(const char* source, size_t length) {
+    Scanner scanner;
+    initScanner(&scanner, source, length);
+    long tokens = 0;
+    for(;;) {
+        Token token = scanToken(&scanner);
+        tokens++;
+        if(token.type == TOKEN_EOF || token.type == TOKEN_ERROR) return tokens;
+    }
+}
+
+/**
+ * Times the scanner, the compiler and the VM on one workload. Each stage is repeated until a
+ * sample takes long enough to time reliably, and the median of the samples is kept.
+ */
+static bool runWorkload(const Workload* workload, bool quick, BenchResult* result) {
+    Buffer source = {malloc(1024), 0, 1024};
+    source.data[0] = '\0';
+    randomState = BENCH_SEED;
+    workload->generate(&source, quick ? workload->quickSize : workload->size);
+
+    double minimumTime = quick ? 0.02 : 0.1;
+    double samples[BENCH_SAMPLES];
+    result->name = workload->name;
+    result->count = 0;
+
+    long tokens = scanAll(source.data, source.length);
+    for(int sample = 0; sample < BENCH_SAMPLES; sample++) {
+        long repeats = 0;
+        double start = now(), elapsed;
+        do {
+            scanAll(source.data, source.length);
+            repeats++;
+        } while((elapsed = now() - start) < minimumTime);
+        samples[sample] = elapsed / repeats;
+    }
+    double scanTime = median(samples);
+
+    for(int sample = 0; sample < BENCH_SAMPLES; sample++) {
+        long repeats = 0;
+        double start = now(), elapsed;
+        do {
+            Chunk chunk;
+            initChunk(&chunk);
+            compileWithParams(source.data, &chunk, paramNames, PARAM_COUNT);
+            freeChunk(&chunk);
+            repeats++;
+        } while((elapsed = now() - start) < minimumTime);
+        samples[sample] = elapsed / repeats;
+    }
+    double compileTime = median(samples);
+
+    Chunk chunk;
+    initChunk(&chunk);
+    if(!compileWithParams(source.data, &chunk, paramNames, PARAM_COUNT)) {
+        fprintf(stderr, "Workload %s does not compile.\n", workload->name);
+        freeChunk(&chunk);
+        free(source.data);
+        return false;
+    }
+    long opcodes = countOpcodes(&chunk);
+
+    VM vm;
+    initVM(&vm);
+    vm.printResult = false;
+    vm.params = paramValues;
+    for(int sample = 0; sample < BENCH_SAMPLES; sample++) {
+        long repeats = 0;
+        double start = now(), elapsed;
+        do {
+            interpretChunk(&vm, &chunk, BACKEND_STACK);
+            repeats++;
+        } while((elapsed = now() - start) < minimumTime);
+        samples[sample] = elapsed / repeats;
+    }
+    double runTime = median(samples);
+
+    vm.jitThreshold = 1;
+    for(int sample = 0; sample < BENCH_SAMPLES; sample++) {
+        long repeats = 0;
+        double start = now(), elapsed;
+        do {
+            interpretChunk(&vm, &chunk, BACKEND_STACK);
+            repeats++;
+        } while((elapsed = now() - start) < minimumTime);
+        samples[sample] = elapsed / repeats;
+    }
+    double jitTime = median(samples);
+
+    size(result, "bytes", (double)source.length);
+    size(result, "tokens", (double)tokens);
+    size(result, "opcodes", (double)opcodes);
+    cost(result, "scan_ns_per_token", scanTime * 1e9 / tokens);
+    rate(result, "scan_bytes_per_s", source.length / scanTime);
+    cost(result, "compile_ns_per_token", compileTime * 1e9 / tokens);
+    rate(result, "compile_bytes_per_s", source.length / compileTime);
+    cost(result, "run_ns_per_opcode", runTime * 1e9 / opcodes);
+    cost(result, "jit_ns_per_opcode", jitTime * 1e9 / opcodes);
+
+    freeVM(&vm);
+    freeChunk(&chunk);
+    free(source.data);
+    return true;
+}
+
+/*
+ * Passes every call on to the heap and counts it, to show how often an allocator goes to malloc.
+ */
+typedef struct {
+    Allocator allocator;
+    long calls;
+} CountingAllocator;
+
+static void* countingReallocate(Allocator* allocator, MemoryCategory category, void* pointer, size_t oldSize,
+                                size_t newSize) {
+    ((CountingAllocator*)allocator)->calls++;
+    return reallocate(&heapAllocator, category, pointer, oldSize, newSize);
+}
+
+#define SMALL_EXPRESSIONS 256
+
+/**
+ * Times interpret() on many short expressions, once compiling into the heap and once into the VM's
+ * arena, and counts the heap calls each makes per expression.
+ */
+static bool runInterpretBenchmark(bool quick, BenchResult* result) {
+    Buffer source = {malloc(1024), 0, 1024};
+    int starts[SMALL_EXPRESSIONS];
+    randomState = BENCH_SEED;
+    for(int i = 0; i < SMALL_EXPRESSIONS; i++) {
+        starts[i] = (int)source.length;
+        int operands = 2 + nextRandom(8);
+        for(int j = 0; j < operands; j++) {
+            if(j > 0) appendOperator(&source);
+            append(&source, "%d", 1 + nextRandom(1000));
+        }
+        // Each expression is its own NUL terminated string within the buffer.
+        append(&source, "%c", '\0');
+    }
+
+    double minimumTime = quick ? 0.02 : 0.1;
+    double samples[BENCH_SAMPLES];
+    double times[2];
+    double calls[2];
+    bool ok = true;
+    for(int mode = 0; mode < 2; mode++) {
+        CountingAllocator counter = {{countingReallocate}, 0};
+        VM vm;
+        initVM(&vm);
+        vm.printResult = false;
+        if(mode == 0) {
+            vm.allocator = &counter.allocator;
+        } else {
+            initArena(&vm.arena, &counter.allocator, ARENA_BLOCK_SIZE);
+        }
+
+        long totalRepeats = 0;
+        long firstCalls = -1;
+        for(int sample = 0; sample < BENCH_SAMPLES; sample++) {
+            long repeats = 0;
+            double start = now(), elapsed;
+            do {
+                for(int i = 0; i < SMALL_EXPRESSIONS; i++) {
+                    ok &= interpret(&vm, source.data + starts[i], BACKEND_STACK) == INTERPRET_OK;
+                }
+                // The arena takes its one block on the first pass, which says nothing about the rest.
+                if(firstCalls < 0) firstCalls = counter.calls;
+                repeats++;
+            } while((elapsed = now() - start) < minimumTime);
+            samples[sample] = elapsed / repeats;
+            totalRepeats += repeats;
+        }
+        times[mode] = median(samples) * 1e9 / SMALL_EXPRESSIONS;
+        calls[mode] = totalRepeats > 1 ? (double)(counter.calls - firstCalls) / ((totalRepeats - 1) * SMALL_EXPRESSIONS) : 0;
+        freeVM(&vm);
+    }
+
+    result->name = "small_interpret";
+    result->count = 0;
+    size(result, "expressions", SMALL_EXPRESSIONS);
+    size(result, "heap_calls_per_expression", calls[0]);
+    size(result, "arena_calls_per_expression", calls[1]);
+    cost(result, "heap_ns_per_expression", times[0]);
+    cost(result, "arena_ns_per_expression", times[1]);
+
+    if(!ok) fprintf(stderr, "Workload small_interpret does not run.\n");
+    free(source.data);
+    return ok;
+}
+
+#define THREAD_SOURCES 2048
+#define MAX_THREAD_COUNTS 8
+
+/**
+ * Times runJobs() on the same batch of sources with 1, 2, 4, ... threads up to the number of online
+ * CPUs, which is always measured last, and reports the sources per second for each, so that the
+ * scaling with core count can be read off directly.
+ */
+static bool runThreadBenchmark(bool quick, BenchResult* result) {
+    static char fields[MAX_THREAD_COUNTS][32];
+    Buffer source = {malloc(1024), 0, 1024};
+    int starts[THREAD_SOURCES];
+    randomState = BENCH_SEED;
+    for(int i = 0; i < THREAD_SOURCES; i++) {
+        starts[i] = (int)source.length;
+        for(int j = 0; j < 64; j++) {
+            if(j > 0) appendOperator(&source);
+            append(&source, "%d", 1 + nextRandom(1000));
+        }
+        append(&source, "%c", '\0');
+    }
+    Job* jobs = malloc(sizeof(Job) * THREAD_SOURCES);
+    for(int i = 0; i < THREAD_SOURCES; i++) {
+        jobs[i].source = source.data + starts[i];
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1) cpus = 1;
+    result->name = "thread_pool";
+    result->count = 0;
+    size(result, "sources", THREAD_SOURCES);
+    size(result, "cpus", (double)cpus);
+
+    double minimumTime = quick ? 0.02 : 0.1;
+    double samples[BENCH_SAMPLES];
+    bool ok = true;
+    int measured = 0;
+    for(long threads = 1; ok; threads = threads * 2 < cpus && measured < MAX_THREAD_COUNTS - 1 ? threads * 2 : cpus) {
+        for(int sample = 0; sample < BENCH_SAMPLES; sample++) {
+            long repeats = 0;
+            double start = now(), elapsed;
+            do {
+                runJobs(jobs, THREAD_SOURCES, (int)threads, BACKEND_STACK);
+                repeats++;
+            } while((elapsed = now() - start) < minimumTime);
+            samples[sample] = elapsed / repeats;
+        }
+        for(int i = 0; i < THREAD_SOURCES; i++) {
+            ok &= jobs[i].status == INTERPRET_OK;
+        }
+        snprintf(fields[measured], sizeof(fields[measured]), "sources_per_s_%ldt", threads);
+        rate(result, fields[measured++], THREAD_SOURCES / median(samples));
+        if(threads == cpus) break;
+    }
+
+    if(!ok) fprintf(stderr, "Workload thread_pool does not run.\n");
+    free(jobs);
+    free(source.data);
+    return ok;
+}
+
+// Parameter values for the JIT check, with the values where arithmetic is easiest to get wrong.
+static const double checkValues[] = {0.0, -0.0, 1.0, -1.5, 0.1, 3.0, 1e308, -1e-310, 5e-324,
+                                     INFINITY, -INFINITY, NAN};
+#define CHECK_VALUE_COUNT (int)(sizeof(checkValues) / sizeof(checkValues[0]))
+#define CHECK_RUNS 8
+
+/**
+ * A random expression for the JIT check. Besides every operator it has negations and right-nested
+ * operands, which make the stack deeper than the registers the JIT keeps it in.
+ */
+static void generateCheck(Buffer* buffer, int depth) {
+    uint32_t choice = depth == 0 ? 0 : nextRandom(8);
+    if(choice == 0) {
+        if(nextRandom(4) == 0) {
+            append(buffer, "%s", nextRandom(2) == 0 ? "0" : "-0");
+        } else {
+            appendOperand(buffer);
+        }
+    } else if(choice == 1) {
+        append(buffer, "-");
+        generateCheck(buffer, depth - 1);
+    } else if(choice < 5) {
+        append(buffer, "(");
+        appendOperand(buffer);
+        appendOperator(buffer);
+        generateCheck(buffer, depth - 1);
+        append(buffer, ")");
+    } else {
+        append(buffer, "(");
+        generateCheck(buffer, depth / 2);
+        appendOperator(buffer);
+        generateCheck(buffer, depth / 2);
+        append(buffer, ")");
+    }
+}
+
+/**
+ * Compiles a chunk for the JIT check in one of the ways the compiler can produce code: directly,
+ * through the peephole passes, or through the expression graph with a shared subexpression, which
+ * is where OP_GET_LOCAL comes from.
+ */
+static bool compileCheck(Buffer* expression, Buffer* source, int variant, Chunk* chunk) {
+    source->length = 0;
+    if(variant == 2) {
+        append(source, "(%s) + (%s) * z", expression->data, expression->data);
+        return compileGraph(source->data, source->length, chunk, paramNames, PARAM_COUNT, false);
+    }
+    append(source, "%s", expression->data);
+    if(!compileWithParams(source->data, chunk, paramNames, PARAM_COUNT)) return false;
+    if(variant == 1) optimizeChunk(chunk, NULL);
+    return true;
+}
+
+/**
+ * Whether native code, from the JIT or an AOT library, got the interpreter's result. Numbers must
+ * match bit for bit, including the sign of zero, except that any NaN matches any NaN: which of two
+ * NaN operands an SSE operation passes on depends on their order, and C leaves the order of the
+ * operands of + and * to the compiler.
+ */
+static bool sameResult(Value expected, Value actual) {
+    if(valuesIdentical(expected, actual)) return true;
+    return IS_NUMBER(expected) && IS_NUMBER(actual) && isnan(AS_NUMBER(expected)) && isnan(AS_NUMBER(actual));
+}
+
+/**
+ * Runs generated expressions on the interpreter and on the JIT and compares the results.
+ * @param count the number of expressions to check
+ * @return the exit code, 1 if any result differs
+ */
+static int checkJit(int count) {
+    Buffer expression = {malloc(1024), 0, 1024};
+    Buffer source = {malloc(1024), 0, 1024};
+    randomState = BENCH_SEED;
+
+    VM interpreter, jit;
+    initVM(&interpreter);
+    initVM(&jit);
+    interpreter.printResult = false;
+    jit.printResult = false;
+    jit.jitThreshold = 1;
+
+    long runs = 0, compiled = 0, mismatches = 0;
+    for(int i = 0; i < count; i++) {
+        expression.length = 0;
+        generateCheck(&expression, 1 + (int)nextRandom(40));
+        Chunk chunk;
+        initChunk(&chunk);
+        if(!compileCheck(&expression, &source, i % 3, &chunk)) {
+            fprintf(stderr, "Generated expression does not compile: %s\n", source.data);
+            freeChunk(&chunk);
+            mismatches++;
+            continue;
+        }
+
+        for(int run = 0; run < CHECK_RUNS; run++) {
+            double params[PARAM_COUNT];
+            for(int param = 0; param < PARAM_COUNT; param++) {
+                params[param] = run == 0 ? paramValues[param] : checkValues[nextRandom(CHECK_VALUE_COUNT)];
+            }
+            interpreter.params = params;
+            jit.params = params;
+            InterpretResult expected = interpretChunk(&interpreter, &chunk, BACKEND_STACK);
+            InterpretResult actual = interpretChunk(&jit, &chunk, BACKEND_STACK);
+            runs++;
+            if(expected == actual && sameResult(interpreter.result, jit.result)) continue;
+
+            if(mismatches++ < 10) {
+                fprintf(stderr, "Mismatch for x = %g, y = %g, z = %g in %s\n  interpreter: ", params[0], params[1],
+                        params[2], source.data);
+                fprintValue(stderr, interpreter.result);
+                fprintf(stderr, "\n  jit:         ");
+                fprintValue(stderr, jit.result);
+                fprintf(stderr, "\n");
+            }
+        }
+        if(chunk.native != NULL && chunk.native->function != NULL) compiled++;
+        freeChunk(&chunk);
+    }
+
+    printf("%d expressions, %ld compiled, %ld runs, %ld mismatches\n", count, compiled, runs, mismatches);
+    freeVM(&interpreter);
+    freeVM(&jit);
+    free(expression.data);
+    free(source.data);
+    return mismatches > 0 ? 1 : 0;
+}
+
+#define AOT_EXPRESSIONS 64
+
+/**
+ * Builds an AOT library from generated expressions with the system C compiler, checks that it gets
+ * the results run() gets, and times both. The library is called through interpret(), as a program
+ * using one would, and directly, which leaves out finding the expression by its source. Without a
+ * C compiler only the number of expressions is reported.
+ */
+static bool runAotBenchmark(bool quick, BenchResult* result) {
+    Buffer source = {malloc(1024), 0, 1024};
+    int starts[AOT_EXPRESSIONS];
+    const char* sources[AOT_EXPRESSIONS];
+    randomState = BENCH_SEED;
+    for(int i = 0; i < AOT_EXPRESSIONS; i++) {
+        starts[i] = (int)source.length;
+        generateTree(&source, 6);
+        append(&source, "%c", '\0');
+    }
+
+    result->name = "aot_library";
+    result->count = 0;
+    size(result, "expressions", AOT_EXPRESSIONS);
+
+    Chunk chunks[AOT_EXPRESSIONS];
+    long opcodes = 0;
+    for(int i = 0; i < AOT_EXPRESSIONS; i++) {
+        sources[i] = source.data + starts[i];
+        initChunk(&chunks[i]);
+        compileWithParams(sources[i], &chunks[i], paramNames, PARAM_COUNT);
+        opcodes += countOpcodes(&chunks[i]);
+    }
+
+    char directory[] = "/tmp/clox_aot_XXXXXX";
+    char cPath[64], libraryPath[64];
+    bool built = false;
+    AotLibrary library;
+    if(mkdtemp(directory) != NULL) {
+        snprintf(cPath, sizeof(cPath), "%s/expressions.c", directory);
+        snprintf(libraryPath, sizeof(libraryPath), "%s/expressions.so", directory);
+        FILE* file = fopen(cPath, "w");
+        if(file != NULL) {
+            bool emitted = emitLibrary(file, sources, AOT_EXPRESSIONS, paramNames, PARAM_COUNT);
+            built = fclose(file) == 0 && emitted && buildLibrary(cPath, libraryPath) &&
+                    loadLibrary(&library, libraryPath);
+        }
+        unlink(cPath);
+        unlink(libraryPath);
+        rmdir(directory);
+    }
+
+    bool ok = true;
+    if(built) {
+        VM vm, aotVM;
+        initVM(&vm);
+        initVM(&aotVM);
+        vm.printResult = false;
+        aotVM.printResult = false;
+        vm.params = paramValues;
+        aotVM.params = paramValues;
+        aotVM.aot = &library;
+
+        const AotEntry* entries[AOT_EXPRESSIONS];
+        for(int i = 0; i < AOT_EXPRESSIONS && ok; i++) {
+            entries[i] = findExpression(&library, sources[i], strlen(sources[i]));
+            ok = entries[i] != NULL && interpretChunk(&vm, &chunks[i], BACKEND_STACK) == INTERPRET_OK &&
+                 interpret(&aotVM, sources[i], BACKEND_STACK) == INTERPRET_OK && sameResult(vm.result, aotVM.result);
+            if(!ok) fprintf(stderr, "The AOT library does not match run() for %s\n", sources[i]);
+        }
+
+        double minimumTime = quick ? 0.02 : 0.1;
+        double samples[BENCH_SAMPLES];
+        double times[3];
+        for(int mode = 0; mode < 3 && ok; mode++) {
+            for(int sample = 0; sample < BENCH_SAMPLES; sample++) {
+                long repeats = 0;
+                double start = now(), elapsed;
+                do {
+                    for(int i = 0; i < AOT_EXPRESSIONS; i++) {
+                        if(mode == 0) {
+                            interpretChunk(&vm, &chunks[i], BACKEND_STACK);
+                        } else if(mode == 1) {
+                            interpret(&aotVM, sources[i], BACKEND_STACK);
+                        } else {
+                            aotVM.result = NUMBER_VAL(entries[i]->function(paramValues));
+                        }
+                    }
+                    repeats++;
+                } while((elapsed = now() - start) < minimumTime);
+                samples[sample] = elapsed / repeats;
+            }
+            times[mode] = median(samples) * 1e9 / opcodes;
+        }
+
+        if(ok) {
+            size(result, "opcodes", (double)opcodes);
+            cost(result, "run_ns_per_opcode", times[0]);
+            cost(result, "aot_interpret_ns_per_opcode", times[1]);
+            cost(result, "aot_call_ns_per_opcode", times[2]);
+        }
+        freeVM(&vm);
+        freeVM(&aotVM);
+        freeLibrary(&library);
+    } else {
+        fprintf(stderr, "Could not build an AOT library, skipping its timings.\n");
+    }
+
+    for(int i = 0; i < AOT_EXPRESSIONS; i++) {
+        freeChunk(&chunks[i]);
+    }
+    free(source.data);
+    return ok;
+}
+
+/*
+ * The switch trie identifierType() used before the perfect hash, with its 't' branch fixed, kept as
+ * the reference the keyword benchmark compares against.
+ */
+static TokenType checkKeyword(const char* word, int wordLength, int start, int length,
+                              const char* rest, TokenType type) {
+    if(wordLength == start + length && memcmp(word + start, rest, length) == 0) return type;
+    return TOKEN_IDENTIFIER;
+}
+
+static TokenType trieKeywordType(const char* word, int length) {
+    switch(word[0]) {
+        case 'a': return checkKeyword(word, length, 1, 2, "nd", TOKEN_AND);
+        case 'c': return checkKeyword(word, length, 1, 4, "lass", TOKEN_CLASS);
+        case 'e': return checkKeyword(word, length, 1, 3, "lse", TOKEN_ELSE);
+        case 'f':
+            if(length > 1) {
+                switch(word[1]) {
+                    case 'a': return checkKeyword(word, length, 2, 3, "lse", TOKEN_FALSE);
+                    case 'o': return checkKeyword(word, length, 2, 1, "r", TOKEN_FOR);
+                    case 'u': return checkKeyword(word, length, 2, 1, "n", TOKEN_FUN);
+                }
+            }
+            break;
+        case 'i': return checkKeyword(word, length, 1, 1, "f", TOKEN_IF);
+        case 'n': return checkKeyword(word, length, 1, 2, "il", TOKEN_NIL);
+        case 'o': return checkKeyword(word, length, 1, 1, "r", TOKEN_OR);
+        case 'p': return checkKeyword(word, length, 1, 4, "rint", TOKEN_PRINT);
+        case 'r': return checkKeyword(word, length, 1, 5, "eturn", TOKEN_RETURN);
+        case 's': return checkKeyword(word, length, 1, 4, "uper", TOKEN_SUPER);
+        case 't':
+            if(length > 1) {
+                switch(word[1]) {
+                    case 'h': return checkKeyword(word, length, 2, 2, "is", TOKEN_THIS);
+                    case 'r': return checkKeyword(word, length, 2, 2, "ue", TOKEN_TRUE);
+                }
+            }
+            break;
+        case 'v': return checkKeyword(word, length, 1, 2, "ar", TOKEN_VAR);
+        case 'w': return checkKeyword(word, length, 1, 4, "hile", TOKEN_WHILE);
+    }
+    return TOKEN_IDENTIFIER;
+}
+
+#define KEYWORD_WORDS 65536
+
+/**
+ * Times keyword recognition over identifier-heavy input: a third keywords, a third words sharing
+ * a prefix with a keyword and a third other identifiers. Both lookups must agree on every word.
+ */
+static bool runKeywordBenchmark(bool quick, BenchResult* result) {
+    static const char* const keywordList[] = {
+            "and", "class", "else", "false", "for", "fun", "if", "nil",
+            "or", "print", "return", "super", "this", "true", "var", "while",
+    };
+    static const char* const nearMisses[] = {
+            "an", "classes", "elsewhere", "f", "form", "funnel", "i", "nill",
+            "order", "printer", "returns", "superb", "thistle", "tru", "variable", "whilst",
+    };
+
+    Buffer words = {malloc(1024), 0, 1024};
+    int* starts = malloc(sizeof(int) * KEYWORD_WORDS);
+    int* lengths = malloc(sizeof(int) * KEYWORD_WORDS);
+    randomState = BENCH_SEED;
+    for(int i = 0; i < KEYWORD_WORDS; i++) {
+        starts[i] = (int)words.length;
+        switch(nextRandom(3)) {
+            case 0: append(&words, "%s", keywordList[nextRandom(16)]); break;
+            case 1: append(&words, "%s", nearMisses[nextRandom(16)]); break;
+            default: {
+                int length = 1 + nextRandom(10);
+                for(int j = 0; j < length; j++) {
+                    append(&words, "%c", j > 0 && nextRandom(4) == 0 ? '0' + nextRandom(10) : 'a' + nextRandom(26));
+                }
+            }
+        }
+        lengths[i] = (int)words.length - starts[i];
+        append(&words, " ");
+    }
+
+    bool agree = true;
+    for(int i = 0; i < KEYWORD_WORDS; i++) {
+        if(keywordType(words.data + starts[i], lengths[i]) != trieKeywordType(words.data + starts[i], lengths[i])) {
+            fprintf(stderr, "Keyword lookups disagree on \"%.*s\".\n", lengths[i], words.data + starts[i]);
+            agree = false;
+        }
+    }
+
+    double minimumTime = quick ? 0.02 : 0.1;
+    double samples[BENCH_SAMPLES];
+    double times[2];
+    for(int lookup = 0; lookup < 2; lookup++) {
+        TokenType (*find)(const char*, int) = lookup == 0 ? keywordType : trieKeywordType;
+        for(int sample = 0; sample < BENCH_SAMPLES; sample++) {
+            long repeats = 0;
+            volatile int sink = 0;
+            double start = now(), elapsed;
+            do {
+                int keywordsFound = 0;
+                for(int i = 0; i < KEYWORD_WORDS; i++) {
+                    keywordsFound += find(words.data + starts[i], lengths[i]) != TOKEN_IDENTIFIER;
+                }
+                sink += keywordsFound;
+                repeats++;
+            } while((elapsed = now() - start) < minimumTime);
+            samples[sample] = elapsed / repeats;
+        }
+        times[lookup] = median(samples) * 1e9 / KEYWORD_WORDS;
+    }
+
+    result->name = "keyword_lookup";
+    result->count = 0;
+    size(result, "words", KEYWORD_WORDS);
+    cost(result, "hash_ns_per_word", times[0]);
+    cost(result, "trie_ns_per_word", times[1]);
+
+    free(words.data);
+    free(starts);
+    free(lengths);
+    return agree;
+}
+
+static void writeResults(FILE* out, BenchResult* results, int count) {
+    fprintf(out, "{\n  \"benchmarks\": [\n");
+    for(int i = 0; i < count; i++) {
+        // One benchmark per line, which is what compareBaseline expects.
+        fprintf(out, "    {\"name\": \"%s\"", results[i].name);
+        for(int j = 0; j < results[i].count; j++) {
+            Measurement* measurement = &results[i].measurements[j];
+            fprintf(out, ", \"%s\": %.*f", measurement->field,
+                    measurement->compared && !measurement->higherIsBetter ? 3 : 0, measurement->value);
+            if(measurement->spread > 0) fprintf(out, ", \"%s_spread\": %.2f", measurement->field, measurement->spread);
+        }
+        fprintf(out, "}%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static bool readField(const char* line, const char* field, double* value) {
+    char key[64];
+    int length = snprintf(key, sizeof(key), "\"%s\": ", field);
+    if(length < 0 || length >= (int)sizeof(key)) return false;
+    const char* found = strstr(line, key);
+    if(found == NULL) return false;
+    *value = strtod(found + strlen(key), NULL);
+    return true;
+}
+
+/**
+ * How much worse than the baseline a metric may get before it counts as a regression. Unless one
+ * was given, the threshold is a multiple of the larger of the spreads measured for the baseline and
+ * for this run, as a difference smaller than the noise between repeats says nothing. Without any
+ * spread, when neither was repeated, the fixed default is used.
+ * @param threshold the threshold in percent given on the command line, negative if none was
+ * @param oldSpread the spread recorded in the baseline, 0 if none was
+ * @param newSpread the spread of this run
+ * @return the threshold in percent
+ */
+static double regressionThreshold(double threshold, double oldSpread, double newSpread) {
+    if(threshold >= 0) return threshold;
+    double spread = oldSpread > newSpread ? oldSpread : newSpread;
+    if(spread <= 0) return DEFAULT_THRESHOLD;
+    return SPREAD_FACTOR * spread > MIN_THRESHOLD ? SPREAD_FACTOR * spread : MIN_THRESHOLD;
+}
+
+/**
+ * Compares the results with a file written by an earlier run. A metric regresses when it is worse
+ * than the baseline by more than regressionThreshold() percent.
+ * @param threshold the threshold given on the command line, negative to derive it from the spread
+ * @return the number of regressions, or -1 if the baseline could not be read
+ */
+static int compareBaseline(const char* path, BenchResult* results, int count, double threshold) {
+    FILE* file = fopen(path, "r");
+    if(file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return -1;
+    }
+
+    int regressions = 0;
+    char line[4096];
+    while(fgets(line, sizeof(line), file) != NULL) {
+        for(int i = 0; i < count; i++) {
+            char name[80];
+            snprintf(name, sizeof(name), "\"name\": \"%s\"", results[i].name);
+            if(strstr(line, name) == NULL) continue;
+
+            for(int j = 0; j < results[i].count; j++) {
+                Measurement* measurement = &results[i].measurements[j];
+                double old;
+                if(!measurement->compared || !readField(line, measurement->field, &old) || old <= 0) continue;
+                char spreadField[64];
+                snprintf(spreadField, sizeof(spreadField), "%s_spread", measurement->field);
+                double oldSpread;
+                if(!readField(line, spreadField, &oldSpread)) oldSpread = 0;
+                double allowed = regressionThreshold(threshold, oldSpread, measurement->spread);
+
+                double change = 100.0 * (measurement->value - old) / old;
+                bool regressed = measurement->higherIsBetter ? change < -allowed : change > allowed;
+                fprintf(stderr, "%-18s %-28s %14.3f -> %14.3f %+7.2f%% (+-%.1f%%)%s\n", results[i].name,
+                        measurement->field, old, measurement->value, change, allowed,
+                        regressed ? "  REGRESSION" : "");
+                if(regressed) regressions++;
+            }
+        }
+    }
+    fclose(file);
+    return regressions;
+}
+
+/**
+ * Runs every benchmark whose name contains the filter.
+ * @param results receives one result per benchmark run
+ * @return the number of results, or -1 if a benchmark failed
+ */
+static int runBenchmarks(bool quick, const char* filter, BenchResult* results) {
+    int workloadCount = (int)(sizeof(workloads) / sizeof(workloads[0]));
+    int count = 0;
+    for(int i = 0; i < workloadCount; i++) {
+        if(filter != NULL && strstr(workloads[i].name, filter) == NULL) continue;
+        if(!runWorkload(&workloads[i], quick, &results[count])) return -1;
+        count++;
+    }
+    if(filter == NULL || strstr("small_interpret", filter) != NULL) {
+        if(!runInterpretBenchmark(quick, &results[count])) return -1;
+        count++;
+    }
+    if(filter == NULL || strstr("thread_pool", filter) != NULL) {
+        if(!runThreadBenchmark(quick, &results[count])) return -1;
+        count++;
+    }
+    if(filter == NULL || strstr("aot_library", filter) != NULL) {
+        if(!runAotBenchmark(quick, &results[count])) return -1;
+        count++;
+    }
+    if(filter == NULL || strstr("keyword_lookup", filter) != NULL) {
+        if(!runKeywordBenchmark(quick, &results[count])) return -1;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Folds repeated runs of the benchmarks into the first one: every measurement becomes the median
+ * over the repeats, and its spread the range of the repeats in percent of that median.
+ * @param runs the results of each repeat, all with the same benchmarks in the same order
+ * @param repeats the number of repeats
+ * @param count the number of benchmarks in each repeat
+ */
+static void combineRepeats(BenchResult runs[][MAX_RESULTS], int repeats, int count) {
+    for(int i = 0; i < count; i++) {
+        BenchResult* result = &runs[0][i];
+        for(int j = 0; j < result->count; j++) {
+            double values[MAX_REPEATS];
+            int found = 0;
+            for(int repeat = 0; repeat < repeats; repeat++) {
+                // A benchmark may leave out timings it could not take, so only repeats with this one count.
+                if(j < runs[repeat][i].count) values[found++] = runs[repeat][i].measurements[j].value;
+            }
+            qsort(values, found, sizeof(double), compareDoubles);
+            Measurement* measurement = &result->measurements[j];
+            measurement->value = found % 2 == 1 ? values[found / 2] : (values[found / 2 - 1] + values[found / 2]) / 2;
+            measurement->spread = found > 1 && measurement->value > 0
+                                  ? 100.0 * (values[found - 1] - values[0]) / measurement->value : 0;
+        }
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    bool quick = false;
+    const char* outputPath = NULL;
+    const char* baselinePath = NULL;
+    const char* filter = NULL;
+    double threshold = -1;
+    int repeats = BENCH_REPEATS;
+    int jitChecks = 0;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if(strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if(strcmp(argv[i], "--threshold") == 0 && i + 1 < argc && strtod(argv[i + 1], NULL) >= 0) {
+            threshold = strtod(argv[++i], NULL);
+        } else if(strcmp(argv[i], "--repeats") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0 &&
+                  atoi(argv[i + 1]) <= MAX_REPEATS) {
+            repeats = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if(strcmp(argv[i], "--jit-check") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            jitChecks = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: clox_bench [--quick] [--output file] [--baseline file] "
+                            "[--threshold percent] [--repeats n] [--filter name] [--jit-check count]\n");
+            return 64;
+        }
+    }
+    if(jitChecks > 0) return checkJit(jitChecks);
+
+    BenchResult runs[MAX_REPEATS][MAX_RESULTS];
+    int count = 0;
+    for(int repeat = 0; repeat < repeats; repeat++) {
+        if((count = runBenchmarks(quick, filter, runs[repeat])) < 0) return 70;
+    }
+    combineRepeats(runs, repeats, count);
+    BenchResult* results = runs[0];
+
+    FILE* out = stdout;
+    if(outputPath != NULL && (out = fopen(outputPath, "w")) == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", outputPath);
+        return 74;
+    }
+    writeResults(out, results, count);
+    if(out != stdout) fclose(out);
+
+    if(baselinePath != NULL) {
+        int regressions = compareBaseline(baselinePath, results, count, threshold);
+        if(regressions < 0) return 74;
+        if(regressions > 0) {
+            fprintf(stderr, "%d regression(s).\n", regressions);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "compiler.h"
+
+#define CACHE_MAGIC "CLXC"
+#define CACHE_VERSION 4
+
+#define CACHE_FLAG_NAN_BOXING 1
+
+#define PATH_MAX_LENGTH 4096
+
+/*
+ * A cache file is this header followed by the code, the line table and the constants of a chunk,
+ * each section starting on an 8 byte boundary so that it can be used in place once mapped.
+ * Values are stored in their in-memory representation, which is why the header records the Value
+ * layout the file was written with. The source the chunk was compiled from comes last: the hash
+ * only names the file, and two sources with the same hash must not share their code.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t valueSize;
+    uint32_t flags;
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+    uint32_t codeCount;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    uint32_t codeOffset;
+    uint32_t lineOffset;
+    uint32_t constantOffset;
+    uint32_t sourceOffset;
+} CacheHeader;
+
+/**
+ * @return the flags describing how values are laid out by this build
+ */
+static uint32_t layoutFlags() {
+#ifdef NAN_BOXING
+    return CACHE_FLAG_NAN_BOXING;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Hashes source text with 64 bit FNV-1a.
+ * @param source the source text
+ * @param length the length of the source text
+ * @return the hash which names the cache file of the source, and the source in an AOT library
+ */
+uint64_t hashSource(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @param size a size in bytes
+ * @return the size rounded up to a multiple of 8
+ */
+static uint32_t align8(size_t size) {
+    return (uint32_t)((size + 7) & ~(size_t)7);
+}
+
+/**
+ * Creates a directory and any missing parents.
+ * @param path the directory to create, modified while walking it but restored on return
+ * @return true if the directory exists afterwards
+ */
+static bool makeDirectories(char* path) {
+    for(char* c = path + 1; *c != '\0'; c++) {
+        if(*c != '/') continue;
+        *c = '\0';
+        bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+        *c = '/';
+        if(!ok) return false;
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+/**
+ * Builds the path of the cache file for a source. The directory is $CLOX_CACHE_DIR, or clox
+ * inside $XDG_CACHE_HOME or ~/.cache when that is not set.
+ * @param hash the hash of the source
+ * @param path buffer of PATH_MAX_LENGTH bytes which receives the file path
+ * @param create whether the directory should be created if it is missing
+ * @return false if there is nowhere to put the cache
+ */
+static bool cachePath(uint64_t hash, char* path, bool create) {
+    char directory[PATH_MAX_LENGTH];
+    const char* base;
+    int length;
+
+    if((base = getenv("CLOX_CACHE_DIR")) != NULL && base[0] != '\0') {
+        length = snprintf(directory, sizeof(directory), "%s", base);
+    } else if((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != '\0') {
+        length = snprintf(directory, sizeof(directory), "%s/clox", base);
+    } else if((base = getenv("HOME")) != NULL && base[0] != '\0') {
+        length = snprintf(directory, sizeof(directory), "%s/.cache/clox", base);
+    } else {
+        return false;
+    }
+    if(length < 0 || length >= (int)sizeof(directory)) return false;
+    if(create && !makeDirectories(directory)) return false;
+
+    length = snprintf(path, PATH_MAX_LENGTH, "%s/%016llx.cloxc", directory, (unsigned long long)hash);
+    return length > 0 && length < PATH_MAX_LENGTH;
+}
+
+/**
+ * Checks that a mapped cache file was written by a compatible build for a source of this hash and
+ * length, and that every section lies inside the file. The source itself is compared by the caller.
+ * @param header the header at the start of the mapping
+ * @param size the size of the mapping
+ * @param hash the hash of the source
+ * @param length the length of the source
+ * @return true if the chunk in the file can be used
+ */
+static bool validHeader(const CacheHeader* header, size_t size, uint64_t hash, size_t length) {
+    if(memcmp(header->magic, CACHE_MAGIC, 4) != 0) return false;
+    if(header->version != CACHE_VERSION) return false;
+    if(header->valueSize != sizeof(Value) || header->flags != layoutFlags()) return false;
+    if(header->sourceHash != hash || header->sourceLength != length) return false;
+    if(header->codeCount == 0 || header->lineCount == 0) return false;
+
+    if(header->codeOffset % 8 != 0 || header->lineOffset % 8 != 0 || header->constantOffset % 8 != 0) {
+        return false;
+    }
+    if((uint64_t)header->codeOffset + header->codeCount > size) return false;
+    if((uint64_t)header->lineOffset + (uint64_t)header->lineCount * sizeof(LineStart) > size) return false;
+    if((uint64_t)header->constantOffset + (uint64_t)header->constantCount * sizeof(Value) > size) return false;
+    if((uint64_t)header->sourceOffset + length > size) return false;
+    return true;
+}
+
+/**
+ * Walks the code of a mapped cache file once, as the run loop trusts its operands and never checks
+ * them itself. Every opcode must be known, every constant index inside the constants and every
+ * local a slot below the top of the stack, the stack must never underflow, and the code must end
+ * with its only OP_RETURN. Cached chunks are compiled without parameters, so OP_GET_PARAM is never
+ * valid in one.
+ * @param header the header of the file, already checked by validHeader()
+ * @param code the code section
+ * @return true if the code can be run
+ */
+static bool validCode(const CacheHeader* header, const uint8_t* code) {
+    uint32_t count = header->codeCount;
+    uint32_t constants = header->constantCount;
+    int64_t depth = 0;
+    for(uint32_t offset = 0; offset < count;) {
+        uint8_t op = code[offset];
+        uint32_t size;
+        switch(op) {
+            case OP_CONSTANT_LONG: size = 4; break;
+            case OP_CONSTANT_CONSTANT: size = 3; break;
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT: size = 2; break;
+            case OP_RETURN:
+            case OP_NEGATE:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE: size = 1; break;
+            default: return false;
+        }
+        if(offset + size > count) return false;
+
+        const uint8_t* operands = code + offset + 1;
+        switch(op) {
+            case OP_CONSTANT:
+                if(operands[0] >= constants) return false;
+                depth++;
+                break;
+            case OP_CONSTANT_LONG:
+                if((uint32_t)(operands[0] | (operands[1] << 8) | (operands[2] << 16)) >= constants) return false;
+                depth++;
+                break;
+            case OP_CONSTANT_CONSTANT:
+                if(operands[0] >= constants || operands[1] >= constants) return false;
+                depth += 2;
+                break;
+            case OP_GET_LOCAL:
+                if(operands[0] >= depth) return false;
+                depth++;
+                break;
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT:
+                if(operands[0] >= constants || depth < 1) return false;
+                break;
+            case OP_NEGATE:
+                if(depth < 1) return false;
+                break;
+            case OP_RETURN:
+                return depth >= 1 && offset + 1 == count;
+            default:
+                if(depth < 2) return false;
+                depth--;
+                break;
+        }
+        offset += size;
+    }
+    return false;
+}
+
+/**
+ * Looks for a cached compilation of the source and maps it. The chunk's code, lines and constants
+ * point straight into the read-only mapping, nothing is copied. freeChunk() unmaps it.
+ * @param source the source text
+ * @param length the length of the source text
+ * @param chunk the chunk to fill
+ * @return true if a valid cache file was found and mapped, false to compile the source instead
+ */
+bool loadCachedChunk(const char* source, size_t length, Chunk* chunk) {
+    uint64_t hash = hashSource(source, length);
+    char path[PATH_MAX_LENGTH];
+    if(!cachePath(hash, path, false)) return false;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat status;
+    if(fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)status.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) return false;
+
+    const CacheHeader* header = (const CacheHeader*)mapping;
+    const uint8_t* code = (const uint8_t*)mapping + header->codeOffset;
+    if(!validHeader(header, size, hash, length) ||
+       memcmp((const uint8_t*)mapping + header->sourceOffset, source, length) != 0 || !validCode(header, code)) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    uint8_t* base = (uint8_t*)mapping;
+    initChunk(chunk);
+    chunk->count = (int)header->codeCount;
+    chunk->code = base + header->codeOffset;
+    chunk->lineCount = (int)header->lineCount;
+    chunk->lines = (LineStart*)(base + header->lineOffset);
+    chunk->constants.count = (int)header->constantCount;
+    chunk->constants.values = (Value*)(base + header->constantOffset);
+    // The stack is sized by maxStack, so it is worked out from the checked code rather than trusted.
+    chunk->maxStack = maxStackDepth(chunk);
+    chunk->mapping = mapping;
+    chunk->mappingSize = size;
+    return true;
+}
+
+/**
+ * Writes a compiled chunk to the cache file for its source. The file is written under a temporary
+ * name and renamed into place, so a concurrent reader never sees half a file. Failures are ignored,
+ * the source will just be compiled again next time.
+ * @param source the source text the chunk was compiled from
+ * @param length the length of the source text
+ * @param chunk the compiled chunk
+ */
+void storeCachedChunk(const char* source, size_t length, Chunk* chunk) {
+    uint64_t hash = hashSource(source, length);
+    char path[PATH_MAX_LENGTH];
+    char temporary[PATH_MAX_LENGTH + 32];
+    if(!cachePath(hash, path, true)) return;
+    snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid());
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.valueSize = sizeof(Value);
+    header.flags = layoutFlags();
+    header.sourceHash = hash;
+    header.sourceLength = length;
+    header.codeCount = (uint32_t)chunk->count;
+    header.lineCount = (uint32_t)chunk->lineCount;
+    header.constantCount = (uint32_t)chunk->constants.count;
+    header.codeOffset = align8(sizeof(CacheHeader));
+    header.lineOffset = align8(header.codeOffset + header.codeCount);
+    header.constantOffset = align8(header.lineOffset + header.lineCount * sizeof(LineStart));
+    header.sourceOffset = header.constantOffset + header.constantCount * sizeof(Value);
+
+    FILE* file = fopen(temporary, "wb");
+    if(file == NULL) return;
+
+    static const uint8_t padding[8] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(padding, 1, header.codeOffset - sizeof(header), file) == header.codeOffset - sizeof(header);
+    ok = ok && fwrite(chunk->code, 1, header.codeCount, file) == header.codeCount;
+    ok = ok && fwrite(padding, 1, header.lineOffset - header.codeOffset - header.codeCount, file) ==
+               header.lineOffset - header.codeOffset - header.codeCount;
+    ok = ok && fwrite(chunk->lines, sizeof(LineStart), header.lineCount, file) == header.lineCount;
+    size_t linesEnd = header.lineOffset + header.lineCount * sizeof(LineStart);
+    ok = ok && fwrite(padding, 1, header.constantOffset - linesEnd, file) == header.constantOffset - linesEnd;
+    ok = ok && fwrite(chunk->constants.values, sizeof(Value), header.constantCount, file) == header.constantCount;
+    ok = ok && fwrite(source, 1, length, file) == length;
+    ok = fclose(file) == 0 && ok;
+
+    if(!ok || rename(temporary, path) != 0) {
+        remove(temporary);
+    }
+}
+
+/**
+ * Fills a chunk with the compiled form of the source, from the cache when possible. Otherwise the
+ * source is compiled and the result is written to the cache for the next run.
+ * @param source the source text, followed by a NUL byte
+ * @param length the length of the source text
+ * @param chunk an initialized chunk to fill
+ * @return false if the source had a compile error
+ */
+bool compileCached(const char* source, size_t length, Chunk* chunk) {
+    if(loadCachedChunk(source, length, chunk)) return true;
+
+    if(!compile(source, length, chunk)) return false;
+    storeCachedChunk(source, length, chunk);
+    return true;
+}
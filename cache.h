@@ -0,0 +1,13 @@
+#ifndef CLOX_CACHE_H
+#define CLOX_CACHE_H
+
+#include <stddef.h>
+
+#include "chunk.h"
+
+uint64_t hashSource(const char* source, size_t length);
+bool loadCachedChunk(const char* source, size_t length, Chunk* chunk);
+void storeCachedChunk(const char* source, size_t length, Chunk* chunk);
+bool compileCached(const char* source, size_t length, Chunk* chunk);
+
+#endif //CLOX_CACHE_H
@@ -1,20 +1,44 @@
+#include <sys/mman.h>
+
 #include "chunk.h"
+#include "jit.h"
+
+/**
+ * Initializes an empty chunk whose arrays live on the heap.
+ * @param chunk the chunk to initialize
+ */
+void initChunk(Chunk* chunk) {
+    initChunkWithAllocator(chunk, &heapAllocator);
+}
 
 /**
  * Initializes the count and capacity of given chunk to 0 and initializes the code and lines
  * of a given chunk to NULL. Also initializes the chunks value array(constants).
  * @param chunk the chunk to initialize
+ * @param allocator the allocator all of the chunk's arrays are kept in
  */
-void initChunk(Chunk* chunk) {
+void initChunkWithAllocator(Chunk* chunk, Allocator* allocator) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
-    initValueArray(&chunk->constants);
+    initValueArray(&chunk->constants, allocator);
+    chunk->maxStack = 0;
+    chunk->constantSlotCapacity = 0;
+    chunk->constantSlots = NULL;
+    chunk->sharedConstants = 0;
+    chunk->mapping = NULL;
+    chunk->mappingSize = 0;
+    chunk->native = NULL;
+    chunk->runs = 0;
+    chunk->allocator = allocator;
 }
 
 /**
- * Adds a byte to the end of a given chunk.
+ * Adds a byte to the end of a given chunk. Lines are run-length encoded, so a new entry is only
+ * added to the line table when the line differs from the line of the previous byte.
  * @param chunk pointer to chunk to append byte to
  * @param byte the byte to add to the end of the chunk
  * @param line the line of code that the given bytecode corresponds to
@@ -23,32 +47,196 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     if(chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(chunk->allocator, MEMORY_BYTECODE, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    if(chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+        return;
+    }
+
+    if(chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(chunk->allocator, MEMORY_LINES, LineStart, chunk->lines,
+                                  oldCapacity, chunk->lineCapacity);
+    }
+    LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
+}
+
+/**
+ * Drops every byte at or after count from the end of the chunk along with the line runs that
+ * start there.
+ * @param chunk the chunk to shorten
+ * @param count the number of bytes to keep
+ */
+void truncateChunk(Chunk* chunk, int count) {
+    // Machine code made from the old bytes no longer matches the chunk.
+    freeNativeCode(chunk->native);
+    chunk->native = NULL;
+    chunk->runs = 0;
+    chunk->count = count;
+    while(chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count) {
+        chunk->lineCount--;
+    }
 }
 
 /**
- * Frees all memory held by the chunk*.
+ * Frees all memory held by the chunk*, including machine code the JIT made from it. A chunk loaded
+ * from the bytecode cache borrows its arrays from a read-only mapping of the cache file, which is
+ * unmapped instead.
  * @param chunk the chunk pointer who's memory is to be freed
  */
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    freeNativeCode(chunk->native);
+    if(chunk->mapping != NULL) {
+        munmap(chunk->mapping, chunk->mappingSize);
+        initChunkWithAllocator(chunk, chunk->allocator);
+        return;
+    }
+    FREE_ARRAY(chunk->allocator, MEMORY_BYTECODE, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(chunk->allocator, MEMORY_LINES, LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
-    initChunk(chunk);
+    FREE_ARRAY(chunk->allocator, MEMORY_CONSTANTS, int, chunk->constantSlots, chunk->constantSlotCapacity);
+    initChunkWithAllocator(chunk, chunk->allocator);
+}
+
+/**
+ * Finds the slot in the constant table which holds the index of a value, or the empty slot where
+ * it would go. The table uses linear probing and stores index + 1 so that 0 marks an empty slot.
+ * @param chunk the chunk which owns the constant table
+ * @param value the value to look for
+ * @return the slot for the value
+ */
+static int findConstantSlot(Chunk* chunk, Value value) {
+    int mask = chunk->constantSlotCapacity - 1;
+    int slot = (int)(hashValue(value) & (uint32_t)mask);
+    for(;;) {
+        int entry = chunk->constantSlots[slot];
+        if(entry == 0 || valuesIdentical(chunk->constants.values[entry - 1], value)) return slot;
+        slot = (slot + 1) & mask;
+    }
+}
+
+/**
+ * Doubles the constant table and reinserts every constant of the chunk.
+ * @param chunk the chunk who's constant table is to be grown
+ */
+static void growConstantSlots(Chunk* chunk) {
+    int oldCapacity = chunk->constantSlotCapacity;
+    FREE_ARRAY(chunk->allocator, MEMORY_CONSTANTS, int, chunk->constantSlots, oldCapacity);
+    chunk->constantSlotCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->constantSlots = GROW_ARRAY(chunk->allocator, MEMORY_CONSTANTS, int, NULL, 0, chunk->constantSlotCapacity);
+    for(int i = 0; i < chunk->constantSlotCapacity; i++) {
+        chunk->constantSlots[i] = 0;
+    }
+    for(int i = 0; i < chunk->constants.count; i++) {
+        chunk->constantSlots[findConstantSlot(chunk, chunk->constants.values[i])] = i + 1;
+    }
 }
 
 /**
- * Adds a value to the end of the chunk's value array.
+ * Adds a value to the chunk's value array unless an identical value is already in it. Constants
+ * are found through a hash table, so the pool only grows with the number of distinct values.
  * @param chunk the chunk which owns the value array
- * @param value the value to append to the end of the chunks value array
- * @return the index in the value array where the value was added
+ * @param value the value to add to the chunks value array
+ * @return the index in the value array where the value can be found
  */
 int addConstant(Chunk* chunk, Value value) {
+    if((chunk->constants.count + 1) * 4 > chunk->constantSlotCapacity * 3) {
+        growConstantSlots(chunk);
+    }
+
+    int slot = findConstantSlot(chunk, value);
+    int entry = chunk->constantSlots[slot];
+    if(entry != 0) {
+        if(entry > chunk->sharedConstants) chunk->sharedConstants = entry;
+        return entry - 1;
+    }
+
     writeValueArray(&chunk->constants, value);
+    chunk->constantSlots[slot] = chunk->constants.count;
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+/**
+ * Gives back a constant which the compiler no longer loads. It is only removed when it is the last
+ * value in the value array and addConstant never handed it out a second time, otherwise other
+ * instructions may still refer to it.
+ * @param chunk the chunk which owns the value array
+ * @param constant the index of the constant which is no longer loaded
+ */
+void dropConstant(Chunk* chunk, int constant) {
+    if(constant != chunk->constants.count - 1 || constant < chunk->sharedConstants) return;
+
+    // Backward shift deletion keeps every probe sequence in the table unbroken without tombstones.
+    int mask = chunk->constantSlotCapacity - 1;
+    int hole = findConstantSlot(chunk, chunk->constants.values[constant]);
+    for(int slot = (hole + 1) & mask; chunk->constantSlots[slot] != 0; slot = (slot + 1) & mask) {
+        int entry = chunk->constantSlots[slot];
+        int home = (int)(hashValue(chunk->constants.values[entry - 1]) & (uint32_t)mask);
+        bool reachable = hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot);
+        if(reachable) continue;
+        chunk->constantSlots[hole] = entry;
+        hole = slot;
+    }
+    chunk->constantSlots[hole] = 0;
+    chunk->constants.count--;
+}
+
+/**
+ * Finds the source line of the byte at a given offset by binary searching the run-length encoded
+ * line table for the last run that starts at or before the offset.
+ * @param chunk the chunk holding the bytecode
+ * @param offset the offset of the byte in the chunks code
+ * @return the line of code that the byte corresponds to
+ */
+int getLine(Chunk* chunk, int offset) {
+    int start = 0;
+    int end = chunk->lineCount - 1;
+
+    while(start < end) {
+        int mid = start + (end - start + 1) / 2;
+        if(chunk->lines[mid].offset <= offset) {
+            start = mid;
+        } else {
+            end = mid - 1;
+        }
+    }
+    return chunk->lines[start].line;
+}
+
+/**
+ * Works out how deep the stack gets while the chunk runs. The code is a single straight line, so
+ * one pass over it adding up the stack effect of every instruction finds the exact maximum.
+ * @param chunk the finished chunk
+ * @return the largest number of values on the stack at any point
+ */
+int maxStackDepth(Chunk* chunk) {
+    int depth = 0;
+    int maxDepth = 0;
+    for(int offset = 0; offset < chunk->count;) {
+        switch(chunk->code[offset]) {
+            case OP_CONSTANT:
+            case OP_GET_PARAM:
+            case OP_GET_LOCAL: depth++; offset += 2; break;
+            case OP_CONSTANT_LONG: depth++; offset += 4; break;
+            case OP_CONSTANT_CONSTANT: depth += 2; offset += 3; break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_RETURN: depth--; offset += 1; break;
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT: offset += 2; break;
+            default: offset += 1; break;
+        }
+        if(depth > maxDepth) maxDepth = depth;
+    }
+    return maxDepth;
+}
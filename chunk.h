@@ -13,19 +13,55 @@ typedef enum {
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    OP_ADD_CONSTANT,
+    OP_SUBTRACT_CONSTANT,
+    OP_MULTIPLY_CONSTANT,
+    OP_DIVIDE_CONSTANT,
+    OP_CONSTANT_CONSTANT,
+    OP_CONSTANT_LONG,
+    OP_GET_PARAM,
+    OP_GET_LOCAL,
 } OpCode;
 
+#define CONSTANT_LONG_MAX 0xffffff
+#define PARAM_MAX (UINT8_MAX + 1)
+
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
+typedef struct NativeCode NativeCode;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
     ValueArray constants;
+    // The most values the code ever has on the stack at once, so the VM can size its stack up front.
+    int maxStack;
+    int constantSlotCapacity;
+    int* constantSlots;
+    int sharedConstants;
+    void* mapping;
+    size_t mappingSize;
+    // Machine code the JIT made from the chunk, and how often the VM ran the chunk before that.
+    NativeCode* native;
+    int runs;
+    Allocator* allocator;
 } Chunk;
 
 void initChunk(Chunk* chunk);
+void initChunkWithAllocator(Chunk* chunk, Allocator* allocator);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+void dropConstant(Chunk* chunk, int constant);
+int getLine(Chunk* chunk, int offset);
+int maxStackDepth(Chunk* chunk);
 
 #endif //CLOX_CHUNK_H
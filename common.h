@@ -5,7 +5,20 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// Packs every Value into the bits of a single double. Comment this out to get the
+// plain tagged struct, which is twice the size but easier to inspect in a debugger.
+#define NAN_BOXING
+
+// Threaded dispatch through a table of label addresses needs the GCC/Clang
+// labels-as-values extension. Everything else falls back to the switch in run().
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// The JIT writes x86-64 machine code into pages mapped with mmap, so it is only built for Linux on
+// x86-64. Elsewhere every chunk is left to the interpreter.
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define X86_64_JIT
+#endif
 
 #endif //CLOX_COMMON_H
@@ -1,22 +1,36 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "graph.h"
 #include "scanner.h"
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif
-
-typedef void (*ParseFn)();
 
 typedef struct {
+    Scanner scanner;
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
+    Chunk* compilingChunk;
+    // The offset of every instruction emitted so far which is still in the chunk, the last one on
+    // top. Constant folding needs the loads of both operands even after an inner fold.
+    int* instructions;
+    int instructionCount;
+    int instructionCapacity;
+    const char* const* params;
+    int paramCount;
+    // When set, the parse functions build this graph instead of emitting bytecode, keeping the
+    // nodes of the operands parsed so far on a stack.
+    ExprGraph* graph;
+    ExprNode** nodes;
+    int nodeCount;
+    int nodeCapacity;
 } Parser;
 
+typedef void (*ParseFn)(Parser* parser);
+
 typedef enum {
     PREC_NONE,
     PREC_ASSIGNMENT,  // =
@@ -37,26 +51,26 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
-Parser parser;
-Chunk* compilingChunk;
 
 /**
+ * @param parser the parser holding the state of the compilation
  * @return the Chunk* which is currently being compiled
  */
-static Chunk* currentChunk() {
-    return compilingChunk;
+static Chunk* currentChunk(Parser* parser) {
+    return parser->compilingChunk;
 }
 
 /**
  * If the compiler is in panic mode then returns. Otherwise the compiler is put in panic mode.
  * The line number of the error is printed out and the error message is printed out. The hadError
  * bool in Parser is set to true.
+ * @param parser the parser holding the state of the compilation
  * @param token the token which has the error line information associated with it.
  * @param message the error message to be printed
  */
-static void errorAt(Token* token, const char* message) {
-    if(parser.panicMode) return;
-    parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if(parser->panicMode) return;
+    parser->panicMode = true;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if(token->type == TOKEN_EOF) {
@@ -68,180 +82,474 @@ static void errorAt(Token* token, const char* message) {
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
 /**
  * Calls errorAt with the parsers previous token.
+ * @param parser the parser holding the state of the compilation
  * @param message the error message to be printed.
  */
-static void error(const char* message) {
-    errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->previous, message);
 }
 
 /**
  * Calls errorAt with the parsers current token
+ * @param parser the parser holding the state of the compilation
  * @param message the error message to be printed
  */
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
 /**
  * Sets the parsers previous token to the current. Then sets the parsers current token to the next token
  * in the source string which is not an error token. All error tokens that occur before the next non-error token
  * are handled by a call to errorAtCurrent.
+ * @param parser the parser holding the state of the compilation
  */
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for(;;) {
-        parser.current = scanToken();
-        if(parser.current.type != TOKEN_ERROR) break;
+        parser->current = scanToken(&parser->scanner);
+        if(parser->current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
 /**
  * Checks if the type of the current token is the same as the expected type. If so then reads next token.
  * Handles and error if not the same.
+ * @param parser the parser holding the state of the compilation
  * @param type the type to compare with the current type
  * @param message error message if the type is not the same
  */
-static void consume(TokenType type, const char* message) {
-    if(parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if(parser->current.type == type) {
+        advance(parser);
         return;
     }
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
 /**
  * Writes a byte to the chunk currently being compiled.
+ * @param parser the parser holding the state of the compilation
  * @param byte the byte to be written
  */
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(currentChunk(parser), byte, parser->previous.line);
+}
+
+/**
+ * Writes an opcode to the end of the chunk currently being compiled and remembers where the
+ * instruction starts so that the next emitter can fuse with it.
+ * @param parser the parser holding the state of the compilation
+ * @param op the opcode to be written
+ */
+static void emitOp(Parser* parser, uint8_t op) {
+    Chunk* chunk = currentChunk(parser);
+    if(parser->instructionCapacity < parser->instructionCount + 1) {
+        int oldCapacity = parser->instructionCapacity;
+        parser->instructionCapacity = GROW_CAPACITY(oldCapacity);
+        parser->instructions = GROW_ARRAY(chunk->allocator, MEMORY_BYTECODE, int, parser->instructions,
+                                          oldCapacity, parser->instructionCapacity);
+    }
+    parser->instructions[parser->instructionCount++] = chunk->count;
+    emitByte(parser, op);
 }
 
 /**
- * Emits 2 bytes to the end of the chunk currently being compiled
- * @param byte1 the first byte to add
- * @param byte2 the second byte to add
+ * @param parser the parser holding the state of the compilation
+ * @param fromTop 0 for the last instruction emitted, 1 for the one before it
+ * @return the offset of the instruction, or -1 if there is none
  */
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static int emittedInstruction(Parser* parser, int fromTop) {
+    return parser->instructionCount > fromTop ? parser->instructions[parser->instructionCount - 1 - fromTop] : -1;
 }
 
 /**
  * Writes the byte corresponding to return opcode to end of chunk currently being compiled.
+ * @param parser the parser holding the state of the compilation
  */
-static void emitReturn() {
-    emitByte(OP_RETURN);
+static void emitReturn(Parser* parser) {
+    emitOp(parser, OP_RETURN);
 }
 
 /**
- * Writes a double to the end of the currently being compiled chunks value array. Handles the error
- * if there are too many values in the value array
- * @param value the double to add to the end of the value array
+ * Writes a value to the end of the currently being compiled chunks value array, unless it is
+ * already there. Handles the error if there are too many values in the value array
+ * @param parser the parser holding the state of the compilation
+ * @param value the value to add to the end of the value array
  * @return the index of the value in the value array
  */
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
-    if(constant > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+static int makeConstant(Parser* parser, Value value) {
+    int constant = addConstant(currentChunk(parser), value);
+    if(constant > CONSTANT_LONG_MAX) {
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
-    return (uint8_t) constant;
+    return constant;
 }
 
 /**
  * Writes a value to the end of the chunks value array.
  * Writes to the end of chunk the opcode corresponding to a constant value and then the index
- * of that value in the value array.
- * @param value the double to be added to the chunks value array
+ * of that value in the value array. Indexes which do not fit in a byte use OP_CONSTANT_LONG with a
+ * 24-bit operand. If the instruction before it also loads a constant the two are fused into a
+ * single OP_CONSTANT_CONSTANT.
+ * @param parser the parser holding the state of the compilation
+ * @param value the value to be added to the chunks value array
+ */
+static void emitConstant(Parser* parser, Value value) {
+    int constant = makeConstant(parser, value);
+    Chunk* chunk = currentChunk(parser);
+    if(constant > UINT8_MAX) {
+        emitOp(parser, OP_CONSTANT_LONG);
+        emitByte(parser, (uint8_t)(constant & 0xff));
+        emitByte(parser, (uint8_t)((constant >> 8) & 0xff));
+        emitByte(parser, (uint8_t)((constant >> 16) & 0xff));
+        return;
+    }
+    int last = emittedInstruction(parser, 0);
+    if(last >= 0 && chunk->code[last] == OP_CONSTANT) {
+        chunk->code[last] = OP_CONSTANT_CONSTANT;
+        emitByte(parser, (uint8_t)constant);
+        return;
+    }
+    emitOp(parser, OP_CONSTANT);
+    emitByte(parser, (uint8_t)constant);
+}
+
+/**
+ * Writes a binary arithmetic instruction. When the right operand is a single OP_CONSTANT the load
+ * is rewritten in place into the fused form which takes the constant as its operand.
+ * @param parser the parser holding the state of the compilation
+ * @param op the opcode which operates on the top two values of the stack
+ * @param constantOp the fused opcode which operates on the top of the stack and a constant
+ */
+static void emitBinary(Parser* parser, OpCode op, OpCode constantOp) {
+    Chunk* chunk = currentChunk(parser);
+    int last = emittedInstruction(parser, 0);
+    if(last >= 0 && chunk->code[last] == OP_CONSTANT) {
+        chunk->code[last] = constantOp;
+        return;
+    }
+    emitOp(parser, op);
+}
+
+/**
+ * Decodes a constant load.
+ * @param parser the parser holding the state of the compilation
+ * @param instruction the offset of an instruction in the chunk being compiled
+ * @param fromTop 0 for the last value the instruction pushes, 1 for the one before it
+ * @return the index of the constant pushed there, or -1 if it is not pushed by a constant load
+ */
+static int loadedConstant(Parser* parser, int instruction, int fromTop) {
+    uint8_t* code = currentChunk(parser)->code + instruction;
+    switch (code[0]) {
+        case OP_CONSTANT:
+            return fromTop == 0 ? code[1] : -1;
+        case OP_CONSTANT_LONG:
+            return fromTop == 0 ? code[1] | (code[2] << 8) | (code[3] << 16) : -1;
+        case OP_CONSTANT_CONSTANT:
+            return fromTop <= 1 ? code[2 - fromTop] : -1;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Looks back at the instructions just emitted to see whether a value on the stack was pushed by
+ * a constant load. This is how the compiler knows an operand is a pure constant.
+ * @param parser the parser holding the state of the compilation
+ * @param depth 0 for the value on top of the stack, 1 for the value below it
+ * @param value set to the number which was loaded if it was a constant
+ * @return true if the value at depth comes from a constant number
+ */
+static bool peekConstant(Parser* parser, int depth, double* value) {
+    int last = emittedInstruction(parser, 0);
+    if(last < 0) return false;
+
+    int constant = loadedConstant(parser, last, depth);
+    int previous = emittedInstruction(parser, 1);
+    if(constant < 0 && depth == 1 && previous >= 0 && loadedConstant(parser, last, 0) >= 0) {
+        constant = loadedConstant(parser, previous, 0);
+    }
+    if(constant < 0) return false;
+
+    Value loaded = currentChunk(parser)->constants.values[constant];
+    if(!IS_NUMBER(loaded)) return false;
+    *value = AS_NUMBER(loaded);
+    return true;
+}
+
+/**
+ * Removes the constant load on top of the stack from the end of the chunk. The constant is given
+ * back to the chunk so that it can leave the value array if nothing else loads it.
+ * @param parser the parser holding the state of the compilation
+ */
+static void removeLastConstant(Parser* parser) {
+    Chunk* chunk = currentChunk(parser);
+    int last = emittedInstruction(parser, 0);
+    int constant = loadedConstant(parser, last, 0);
+
+    if(chunk->code[last] == OP_CONSTANT_CONSTANT) {
+        chunk->code[last] = OP_CONSTANT;
+        truncateChunk(chunk, chunk->count - 1);
+    } else {
+        truncateChunk(chunk, last);
+        parser->instructionCount--;
+    }
+    dropConstant(chunk, constant);
+}
+
+/**
+ * Pushes the node of an operand which has just been parsed.
+ * @param parser the parser holding the state of the compilation
+ * @param node the node, NULL after a parse error
+ */
+static void pushNode(Parser* parser, ExprNode* node) {
+    if(parser->nodeCapacity < parser->nodeCount + 1) {
+        int oldCapacity = parser->nodeCapacity;
+        parser->nodeCapacity = GROW_CAPACITY(oldCapacity);
+        parser->nodes = GROW_ARRAY(&parser->graph->arena.allocator, MEMORY_VM, ExprNode*, parser->nodes,
+                                   oldCapacity, parser->nodeCapacity);
+    }
+    parser->nodes[parser->nodeCount++] = node;
+}
+
+static ExprNode* popNode(Parser* parser) {
+    return parser->nodeCount > 0 ? parser->nodes[--parser->nodeCount] : NULL;
+}
+
+static void emitNodeOperator(Parser* parser, NodeType type) {
+    switch(type) {
+        case NODE_ADD: emitBinary(parser, OP_ADD, OP_ADD_CONSTANT); break;
+        case NODE_SUBTRACT: emitBinary(parser, OP_SUBTRACT, OP_SUBTRACT_CONSTANT); break;
+        case NODE_MULTIPLY: emitBinary(parser, OP_MULTIPLY, OP_MULTIPLY_CONSTANT); break;
+        default: emitBinary(parser, OP_DIVIDE, OP_DIVIDE_CONSTANT); break;
+    }
+}
+
+/**
+ * Emits the code computing a node, which leaves its value on top of the stack. A node which is
+ * kept in a local is loaded from there instead of being computed again.
+ * @param parser the parser holding the state of the compilation
+ * @param node the node to emit
  */
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static void lowerNode(Parser* parser, ExprNode* node) {
+    // The emit functions take the line from the previous token, which is long gone by now.
+    parser->previous.line = node->line;
+    if(node->local >= 0) {
+        emitOp(parser, OP_GET_LOCAL);
+        emitByte(parser, (uint8_t)node->local);
+        return;
+    }
+
+    switch(node->type) {
+        case NODE_CONSTANT:
+            emitConstant(parser, NUMBER_VAL(node->number));
+            return;
+        case NODE_PARAM:
+            emitOp(parser, OP_GET_PARAM);
+            emitByte(parser, (uint8_t)node->param);
+            return;
+        case NODE_NEGATE:
+            lowerNode(parser, node->left);
+            parser->previous.line = node->line;
+            emitOp(parser, OP_NEGATE);
+            return;
+        default:
+            break;
+    }
+
+    ExprNode* right = node->right;
+    // Fast math turns every division into a multiplication by a shared reciprocal. Where nothing
+    // shares it, dividing directly is both cheaper and exact.
+    if(parser->graph->fastMath && node->type == NODE_MULTIPLY && right->type == NODE_DIVIDE &&
+       right->uses == 1 && right->local < 0 && right->left->type == NODE_CONSTANT && right->left->number == 1.0) {
+        lowerNode(parser, node->left);
+        lowerNode(parser, right->right);
+        parser->previous.line = node->line;
+        emitNodeOperator(parser, NODE_DIVIDE);
+        return;
+    }
+
+    lowerNode(parser, node->left);
+    lowerNode(parser, right);
+    parser->previous.line = node->line;
+    emitNodeOperator(parser, node->type);
 }
 
 /**
- * writes the return opcode to the end of the chunk
+ * Emits the code for the whole graph. Every operation the expression uses more than once is
+ * computed first, in id order so that what it depends on is already there, and left on the bottom
+ * of the stack for OP_GET_LOCAL to copy. The expression itself is computed on top of those.
+ * @param parser the parser holding the state of the compilation
+ * @param root the node of the whole expression
  */
-static void endCompiler() {
-    emitReturn();
-#ifdef DEBUG_PRINT_CODE
-    if(!parser.hadError) {
-        disassembleChunk(currentChunk(), "code");
+static void lowerGraph(Parser* parser, ExprNode* root) {
+    ExprGraph* graph = parser->graph;
+    countUses(graph, root);
+
+    int locals = 0;
+    for(int id = 0; id < graph->nodeCount && locals <= UINT8_MAX; id++) {
+        ExprNode* node = graph->nodes[id];
+        if(node->uses < 2 || node->type == NODE_CONSTANT || node->type == NODE_PARAM) continue;
+        lowerNode(parser, node);
+        node->local = locals++;
     }
-#endif
+    lowerNode(parser, root);
+}
+
+/**
+ * writes the return opcode to the end of the chunk and records how much stack it needs
+ * @param parser the parser holding the state of the compilation
+ */
+static void endCompiler(Parser* parser) {
+    emitReturn(parser);
+    parser->compilingChunk->maxStack = maxStackDepth(parser->compilingChunk);
 }
 
-static void expression();
+static void expression(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
+static bool compileParser(Parser* parser, Chunk* chunk);
 
-static void parsePrecedence(Precedence precedence) {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if(prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
-    prefixRule();
+    prefixRule(parser);
 
-    while(precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
+    while(precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser);
     }
 }
 
 /**
  *
+ * @param parser the parser holding the state of the compilation
  */
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void binary() {
-    TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser) {
+    TokenType operatorType = parser->previous.type;
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence) (rule->precedence + 1));
+    parsePrecedence(parser, (Precedence) (rule->precedence + 1));
+
+    if(parser->graph != NULL) {
+        NodeType type;
+        switch (operatorType) {
+            case TOKEN_PLUS: type = NODE_ADD; break;
+            case TOKEN_MINUS: type = NODE_SUBTRACT; break;
+            case TOKEN_STAR: type = NODE_MULTIPLY; break;
+            case TOKEN_SLASH: type = NODE_DIVIDE; break;
+            default: return;
+        }
+        ExprNode* right = popNode(parser);
+        ExprNode* left = popNode(parser);
+        pushNode(parser, graphBinary(parser->graph, type, left, right, parser->previous.line));
+        return;
+    }
+
+    double a, b;
+    if(peekConstant(parser, 1, &a) && peekConstant(parser, 0, &b)) {
+        double result;
+        switch (operatorType) {
+            case TOKEN_PLUS: result = a + b; break;
+            case TOKEN_MINUS: result = a - b; break;
+            case TOKEN_STAR: result = a * b; break;
+            case TOKEN_SLASH: result = a / b; break;
+            default: return;
+        }
+        removeLastConstant(parser);
+        removeLastConstant(parser);
+        emitConstant(parser, NUMBER_VAL(result));
+        return;
+    }
 
     switch (operatorType) {
         case TOKEN_PLUS:
-            emitByte(OP_ADD); break;
+            emitBinary(parser, OP_ADD, OP_ADD_CONSTANT); break;
         case TOKEN_MINUS:
-            emitByte(OP_SUBTRACT); break;
+            emitBinary(parser, OP_SUBTRACT, OP_SUBTRACT_CONSTANT); break;
         case TOKEN_STAR:
-            emitByte(OP_MULTIPLY); break;
+            emitBinary(parser, OP_MULTIPLY, OP_MULTIPLY_CONSTANT); break;
         case TOKEN_SLASH:
-            emitByte(OP_DIVIDE); break;
+            emitBinary(parser, OP_DIVIDE, OP_DIVIDE_CONSTANT); break;
         default: return;
     }
 }
 
-static void grouping() {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after exrpession.");
+static void grouping(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after exrpession.");
+}
+
+static void number(Parser* parser) {
+    double value = strtod(parser->previous.start, NULL);
+    if(parser->graph != NULL) {
+        pushNode(parser, graphConstant(parser->graph, value, parser->previous.line));
+        return;
+    }
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void number() {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(value);
+/**
+ * Compiles a reference to one of the named input parameters into an OP_GET_PARAM of its index.
+ * @param parser the parser holding the state of the compilation
+ */
+static void parameter(Parser* parser) {
+    Token* name = &parser->previous;
+    for(int i = 0; i < parser->paramCount; i++) {
+        const char* param = parser->params[i];
+        if((int)strlen(param) == name->length && memcmp(param, name->start, name->length) == 0) {
+            if(parser->graph != NULL) {
+                pushNode(parser, graphParam(parser->graph, i, name->line));
+                return;
+            }
+            emitOp(parser, OP_GET_PARAM);
+            emitByte(parser, (uint8_t)i);
+            return;
+        }
+    }
+    error(parser, "Undefined parameter.");
 }
 
-static void unary() {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser) {
+    TokenType operatorType = parser->previous.type;
+
+    parsePrecedence(parser, PREC_UNARY);
+
+    if(parser->graph != NULL) {
+        if(operatorType == TOKEN_MINUS) {
+            pushNode(parser, graphNegate(parser->graph, popNode(parser), parser->previous.line));
+        }
+        return;
+    }
 
-    parsePrecedence(PREC_UNARY);
+    double value;
+    if(operatorType == TOKEN_MINUS && peekConstant(parser, 0, &value)) {
+        removeLastConstant(parser);
+        emitConstant(parser, NUMBER_VAL(-value));
+        return;
+    }
 
     switch (operatorType) {
         case TOKEN_MINUS:
-            emitByte(OP_NEGATE); break;
+            emitOp(parser, OP_NEGATE); break;
         default: return;
     }
 }
@@ -266,7 +574,7 @@ ParseRule rules[] = {
         [TOKEN_GREATER_EQUAL] = {NULL,     NULL,   PREC_NONE},
         [TOKEN_LESS]          = {NULL,     NULL,   PREC_NONE},
         [TOKEN_LESS_EQUAL]    = {NULL,     NULL,   PREC_NONE},
-        [TOKEN_IDENTIFIER]    = {NULL,     NULL,   PREC_NONE},
+        [TOKEN_IDENTIFIER]    = {parameter, NULL,  PREC_NONE},
         [TOKEN_STRING]        = {NULL,     NULL,   PREC_NONE},
         [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
         [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
@@ -293,17 +601,291 @@ static ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
-bool compile(const char* source, Chunk* chunk) {
-    initScanner(source);
+/**
+ * Compiles source text into a chunk. All of the compiler's state lives in a Parser on this call's
+ * stack, so any number of threads can compile at the same time.
+ * @param source the source text, followed by a NUL byte
+ * @param length the length of the source text
+ * @param chunk the chunk to write the bytecode to
+ * @return false if there was a compile error
+ */
+bool compile(const char* source, size_t length, Chunk* chunk) {
+    Parser parser;
+    parser.params = NULL;
+    parser.paramCount = 0;
+    parser.graph = NULL;
+    initScanner(&parser.scanner, source, length);
+    return compileParser(&parser, chunk);
+}
+
+/**
+ * Compiles an expression which may refer to named input parameters. Each name compiles to an
+ * OP_GET_PARAM of its position in params, so the caller supplies the values in the same order.
+ * @param source the NUL terminated source text
+ * @param chunk the chunk to write the bytecode to
+ * @param params the names of the parameters
+ * @param paramCount the number of parameters, at most PARAM_MAX
+ * @return false if there was a compile error
+ */
+bool compileWithParams(const char* source, Chunk* chunk, const char* const params[], int paramCount) {
+    if(paramCount > PARAM_MAX) {
+        fprintf(stderr, "Error: Too many parameters.\n");
+        return false;
+    }
+
+    Parser parser;
+    parser.params = params;
+    parser.paramCount = paramCount;
+    parser.graph = NULL;
+    initScanner(&parser.scanner, source, strlen(source));
+    return compileParser(&parser, chunk);
+}
 
-    compilingChunk = chunk;
+/**
+ * Compiles an expression through an expression graph rather than straight to bytecode. The graph
+ * is hash-consed, so a subexpression which appears more than once is computed once and loaded
+ * with OP_GET_LOCAL after that. Without fast math the result is bit for bit what compile() gives.
+ * @param source the source text, followed by a NUL byte
+ * @param length the length of the source text
+ * @param chunk the chunk to write the bytecode to
+ * @param params the names of the parameters, or NULL
+ * @param paramCount the number of parameters, at most PARAM_MAX
+ * @param fastMath whether to also reassociate and multiply by reciprocals, which can change the
+ *                 last bits of a result
+ * @return false if there was a compile error
+ */
+bool compileGraph(const char* source, size_t length, Chunk* chunk, const char* const params[], int paramCount,
+                  bool fastMath) {
+    if(paramCount > PARAM_MAX) {
+        fprintf(stderr, "Error: Too many parameters.\n");
+        return false;
+    }
 
-    parser.hadError = false;
-    parser.panicMode = false;
+    ExprGraph graph;
+    initGraph(&graph, fastMath);
+    Parser parser;
+    parser.params = params;
+    parser.paramCount = paramCount;
+    parser.graph = &graph;
+    parser.nodes = NULL;
+    parser.nodeCount = 0;
+    parser.nodeCapacity = 0;
+    initScanner(&parser.scanner, source, length);
+
+    bool compiled = compileParser(&parser, chunk);
+    freeGraph(&graph);
+    return compiled;
+}
 
-    advance();
-    expression();
-    consume(TOKEN_EOF, "Expect end of expression.");
-    endCompiler();
-    return !parser.hadError;
+/**
+ * Compiles an expression read from a stream. The source is scanned through a buffer of
+ * STREAM_BUFFER_SIZE bytes, so memory used for the source stays the same however long it is.
+ * @param stream the stream to read the source from
+ * @param chunk the chunk to write the bytecode to
+ * @return false if there was a compile error
+ */
+bool compileStream(FILE* stream, Chunk* chunk) {
+    Parser parser;
+    parser.params = NULL;
+    parser.paramCount = 0;
+    parser.graph = NULL;
+    initStreamScanner(&parser.scanner, stream, STREAM_BUFFER_SIZE);
+    // The parser reads the text of the previous token after scanning the next one.
+    parser.previous.start = NULL;
+    pinToken(&parser.scanner, &parser.previous);
+
+    bool compiled = compileParser(&parser, chunk);
+    freeStreamScanner(&parser.scanner);
+    return compiled;
+}
+
+/**
+ * Runs a parser whose scanner and parameters are set up over a whole expression.
+ * @param parser the parser to run
+ * @param chunk the chunk to write the bytecode to
+ * @return false if there was a compile error
+ */
+static bool compileParser(Parser* parser, Chunk* chunk) {
+    parser->compilingChunk = chunk;
+    parser->instructions = NULL;
+    parser->instructionCount = 0;
+    parser->instructionCapacity = 0;
+
+    parser->hadError = false;
+    parser->panicMode = false;
+
+    advance(parser);
+    expression(parser);
+    consume(parser, TOKEN_EOF, "Expect end of expression.");
+    if(parser->graph != NULL && !parser->hadError) lowerGraph(parser, popNode(parser));
+    endCompiler(parser);
+    FREE_ARRAY(chunk->allocator, MEMORY_BYTECODE, int, parser->instructions, parser->instructionCapacity);
+    return !parser->hadError;
+}
+
+typedef struct {
+    bool isConstant;
+    int index;
+} Operand;
+
+/**
+ * Makes sure an operand lives in a register. Constants are loaded into the register of the stack
+ * slot they occupy, which is always free because nothing above the slot is live.
+ * @param regChunk the register chunk being written
+ * @param operand the operand to load, updated to refer to its register
+ * @param slot the stack slot the operand occupies
+ * @param line the line of the instruction which needs the operand
+ * @return true, loading a constant cannot fail
+ */
+static bool toRegister(RegChunk* regChunk, Operand* operand, int slot, int line) {
+    if(!operand->isConstant) return true;
+
+    if(operand->index > UINT16_MAX) {
+        writeRegChunk(regChunk, REG_ABX(ROP_LOADKX, slot, 0), line);
+        writeRegChunk(regChunk, (uint32_t)operand->index, line);
+    } else {
+        writeRegChunk(regChunk, REG_ABX(ROP_LOADK, slot, operand->index), line);
+    }
+    operand->isConstant = false;
+    operand->index = slot;
+    return true;
+}
+
+/**
+ * Emits a three-address arithmetic instruction which stores into the register of the left
+ * operands slot. Constant operands are encoded inline when the index fits in a byte.
+ * @param regChunk the register chunk being written
+ * @param op the _RR form of the operation, the _RK and _KR forms must directly follow it
+ * @param a the left operand
+ * @param b the right operand
+ * @param slot the stack slot of the left operand which receives the result
+ * @param line the line of the stack instruction being translated
+ * @return false if a constant could not be loaded
+ */
+static bool emitArithmetic(RegChunk* regChunk, RegOpCode op, Operand* a, Operand* b, int slot, int line) {
+    if(a->isConstant && (b->isConstant || a->index > UINT8_MAX)) {
+        if(!toRegister(regChunk, a, slot, line)) return false;
+    }
+    if(b->isConstant && b->index > UINT8_MAX) {
+        if(!toRegister(regChunk, b, slot + 1, line)) return false;
+    }
+
+    RegOpCode form = op;
+    if(b->isConstant) form = (RegOpCode)(op + 1);
+    if(a->isConstant) form = (RegOpCode)(op + 2);
+    writeRegChunk(regChunk, REG_ABC(form, slot, a->index, b->index), line);
+    a->isConstant = false;
+    a->index = slot;
+    return true;
+}
+
+/**
+ * @param instruction a stack arithmetic opcode, plain or with a constant operand
+ * @return the _RR form of the matching register instruction
+ */
+static RegOpCode arithmeticOp(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD:
+        case OP_ADD_CONSTANT: return ROP_ADD_RR;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_CONSTANT: return ROP_SUBTRACT_RR;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_CONSTANT: return ROP_MULTIPLY_RR;
+        default: return ROP_DIVIDE_RR;
+    }
+}
+
+/**
+ * Translates the stack bytecode of a chunk into three-address register code. Every stack slot is
+ * given its own register, and constants are kept as operands until an instruction consumes them so
+ * that most of them never need to be loaded at all.
+ * @param chunk the compiled stack chunk
+ * @param regChunk the register chunk to write to, it shares the constants of chunk
+ * @return true if the chunk could be translated
+ */
+bool compileRegisters(Chunk* chunk, RegChunk* regChunk) {
+    Operand stack[REGISTER_MAX + 2];
+    int depth = 0;
+    bool ok = true;
+
+    for(int offset = 0; offset < chunk->count && ok;) {
+        uint8_t instruction = chunk->code[offset];
+        int line = getLine(chunk, offset);
+
+        switch (instruction) {
+            case OP_CONSTANT:
+                stack[depth++] = (Operand){true, chunk->code[offset + 1]};
+                offset += 2;
+                break;
+            case OP_CONSTANT_CONSTANT:
+                stack[depth++] = (Operand){true, chunk->code[offset + 1]};
+                stack[depth++] = (Operand){true, chunk->code[offset + 2]};
+                offset += 3;
+                break;
+            case OP_CONSTANT_LONG: {
+                int constant = chunk->code[offset + 1] |
+                               (chunk->code[offset + 2] << 8) |
+                               (chunk->code[offset + 3] << 16);
+                stack[depth++] = (Operand){true, constant};
+                offset += 4;
+                break;
+            }
+            case OP_GET_PARAM:
+                writeRegChunk(regChunk, REG_ABC(ROP_LOADPARAM, depth, chunk->code[offset + 1], 0), line);
+                stack[depth] = (Operand){false, depth};
+                depth++;
+                offset += 2;
+                break;
+            case OP_NEGATE: {
+                Operand* operand = &stack[depth - 1];
+                ok = toRegister(regChunk, operand, depth - 1, line);
+                writeRegChunk(regChunk, REG_ABC(ROP_NEGATE, depth - 1, operand->index, 0), line);
+                operand->index = depth - 1;
+                offset += 1;
+                break;
+            }
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                ok = emitArithmetic(regChunk, arithmeticOp(instruction),
+                                    &stack[depth - 2], &stack[depth - 1], depth - 2, line);
+                depth--;
+                offset += 1;
+                break;
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT: {
+                Operand constant = {true, chunk->code[offset + 1]};
+                ok = emitArithmetic(regChunk, arithmeticOp(instruction),
+                                    &stack[depth - 1], &constant, depth - 1, line);
+                offset += 2;
+                break;
+            }
+            case OP_RETURN: {
+                Operand* operand = &stack[depth - 1];
+                ok = toRegister(regChunk, operand, depth - 1, line);
+                writeRegChunk(regChunk, REG_ABC(ROP_RETURN, operand->index, 0, 0), line);
+                depth--;
+                offset += 1;
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+
+        if(depth > regChunk->registerCount) regChunk->registerCount = depth;
+        if(depth > REGISTER_MAX) {
+            fprintf(stderr, "[line %d] Error: Expression too deep for the register backend.\n", line);
+            return false;
+        }
+    }
+
+    if(!ok) {
+        fprintf(stderr, "Error: Chunk cannot be translated for the register backend.\n");
+        return false;
+    }
+    return true;
 }
\ No newline at end of file
@@ -1,8 +1,16 @@
 #ifndef CLOX_COMPILER_H
 #define CLOX_COMPILER_H
 
+#include <stdio.h>
+
 #include "vm.h"
+#include "regchunk.h"
 
-bool compile(const char* source, Chunk* chunk);
+bool compile(const char* source, size_t length, Chunk* chunk);
+bool compileWithParams(const char* source, Chunk* chunk, const char* const params[], int paramCount);
+bool compileGraph(const char* source, size_t length, Chunk* chunk, const char* const params[], int paramCount,
+                  bool fastMath);
+bool compileStream(FILE* stream, Chunk* chunk);
+bool compileRegisters(Chunk* chunk, RegChunk* regChunk);
 
 #endif //CLOX_COMPILER_H
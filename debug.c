@@ -3,54 +3,204 @@
 #include "debug.h"
 #include "value.h"
 
-void disassembleChunk(Chunk* chunk, const char* name) {
-    printf("== %s ==\n", name);
+void disassembleChunk(FILE* out, Chunk* chunk, const char* name) {
+    fprintf(out, "== %s ==\n", name);
 
     for(int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(out, chunk, offset);
     }
 }
 
-static int simpleInstruction(const char* name, int offset) {
-    printf("%s\n", name);
+static const char* opcodeNames[] = {
+        [OP_CONSTANT]          = "OP_CONSTANT",
+        [OP_RETURN]            = "OP_RETURN",
+        [OP_NEGATE]            = "OP_NEGATE",
+        [OP_ADD]               = "OP_ADD",
+        [OP_SUBTRACT]          = "OP_SUBTRACT",
+        [OP_MULTIPLY]          = "OP_MULTIPLY",
+        [OP_DIVIDE]            = "OP_DIVIDE",
+        [OP_ADD_CONSTANT]      = "OP_ADD_CONSTANT",
+        [OP_SUBTRACT_CONSTANT] = "OP_SUBTRACT_CONSTANT",
+        [OP_MULTIPLY_CONSTANT] = "OP_MULTIPLY_CONSTANT",
+        [OP_DIVIDE_CONSTANT]   = "OP_DIVIDE_CONSTANT",
+        [OP_CONSTANT_CONSTANT] = "OP_CONSTANT_CONSTANT",
+        [OP_CONSTANT_LONG]     = "OP_CONSTANT_LONG",
+        [OP_GET_PARAM]         = "OP_GET_PARAM",
+        [OP_GET_LOCAL]         = "OP_GET_LOCAL",
+};
+
+const char* opcodeName(uint8_t opcode) {
+    if(opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[opcode] == NULL) {
+        return "OP_UNKNOWN";
+    }
+    return opcodeNames[opcode];
+}
+
+static int simpleInstruction(FILE* out, const char* name, int offset) {
+    fprintf(out, "%s\n", name);
     return offset + 1;
 }
 
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
+static int constantInstruction(FILE* out, const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(out, "%-16s %4d '", name, constant);
+    fprintValue(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
     return offset + 2;
 }
 
-int disassembleInstruction(Chunk* chunk, int offset) {
-    printf("%04d ", offset);
+static int constantConstantInstruction(FILE* out, const char* name, Chunk* chunk, int offset) {
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    fprintf(out, "%-16s %4d '", name, first);
+    fprintValue(out, chunk->constants.values[first]);
+    fprintf(out, "' %4d '", second);
+    fprintValue(out, chunk->constants.values[second]);
+    fprintf(out, "'\n");
+    return offset + 3;
+}
+
+static int constantLongInstruction(FILE* out, const char* name, Chunk* chunk, int offset) {
+    uint32_t constant = chunk->code[offset + 1] |
+                        (chunk->code[offset + 2] << 8) |
+                        (chunk->code[offset + 3] << 16);
+    fprintf(out, "%-16s %4d '", name, constant);
+    fprintValue(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
+    return offset + 4;
+}
 
-    if(offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
-        printf("   | ");
+static int byteInstruction(FILE* out, const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    fprintf(out, "%-16s %4d\n", name, slot);
+    return offset + 2;
+}
+
+int disassembleInstruction(FILE* out, Chunk* chunk, int offset) {
+    fprintf(out, "%04d ", offset);
+
+    int line = getLine(chunk, offset);
+    if(offset > 0 && line == getLine(chunk, offset - 1)) {
+        fprintf(out, "   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        fprintf(out, "%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
     switch(instruction) {
         case OP_RETURN:
-            return simpleInstruction("OP_RETURN", offset);
+            return simpleInstruction(out, "OP_RETURN", offset);
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
+            return constantInstruction(out, "OP_CONSTANT", chunk, offset);
         case OP_NEGATE:
-            return simpleInstruction("OP_NEGATE", offset);
+            return simpleInstruction(out, "OP_NEGATE", offset);
         case OP_ADD:
-            return simpleInstruction("OP_ADD", offset);
+            return simpleInstruction(out, "OP_ADD", offset);
         case OP_SUBTRACT:
-            return simpleInstruction("OP_SUBTRACT", offset);
+            return simpleInstruction(out, "OP_SUBTRACT", offset);
         case OP_MULTIPLY:
-            return simpleInstruction("OP_MULTIPLY", offset);
+            return simpleInstruction(out, "OP_MULTIPLY", offset);
         case OP_DIVIDE:
-            return simpleInstruction("OP_DIVIDE", offset);
+            return simpleInstruction(out, "OP_DIVIDE", offset);
+        case OP_ADD_CONSTANT:
+            return constantInstruction(out, "OP_ADD_CONSTANT", chunk, offset);
+        case OP_SUBTRACT_CONSTANT:
+            return constantInstruction(out, "OP_SUBTRACT_CONSTANT", chunk, offset);
+        case OP_MULTIPLY_CONSTANT:
+            return constantInstruction(out, "OP_MULTIPLY_CONSTANT", chunk, offset);
+        case OP_DIVIDE_CONSTANT:
+            return constantInstruction(out, "OP_DIVIDE_CONSTANT", chunk, offset);
+        case OP_CONSTANT_CONSTANT:
+            return constantConstantInstruction(out, "OP_CONSTANT_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction(out, "OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_PARAM:
+            return byteInstruction(out, "OP_GET_PARAM", chunk, offset);
+        case OP_GET_LOCAL:
+            return byteInstruction(out, "OP_GET_LOCAL", chunk, offset);
+        default:
+            fprintf(out, "Unknown opcode %d\n", instruction);
+            return offset + 1;
+    }
+}
+
+void disassembleRegChunk(FILE* out, RegChunk* chunk, const char* name) {
+    fprintf(out, "== %s (%d registers) ==\n", name, chunk->registerCount);
+
+    for(int offset = 0; offset < chunk->count;) {
+        offset = disassembleRegInstruction(out, chunk, offset);
+    }
+}
+
+static void regOperand(FILE* out, RegChunk* chunk, bool isConstant, int index) {
+    if(isConstant) {
+        fprintf(out, " k%d '", index);
+        fprintValue(out, chunk->constants->values[index]);
+        fprintf(out, "'");
+    } else {
+        fprintf(out, " r%d", index);
+    }
+}
+
+static int regArithmeticInstruction(FILE* out, const char* name, RegChunk* chunk, int offset) {
+    uint32_t instruction = chunk->code[offset];
+    int form = (REG_OP(instruction) - ROP_ADD_RR) % 3;
+    fprintf(out, "%-16s r%d,", name, REG_A(instruction));
+    regOperand(out, chunk, form == 2, REG_B(instruction));
+    fprintf(out, ",");
+    regOperand(out, chunk, form == 1, REG_C(instruction));
+    fprintf(out, "\n");
+    return offset + 1;
+}
+
+int disassembleRegInstruction(FILE* out, RegChunk* chunk, int offset) {
+    fprintf(out, "%04d ", offset);
+
+    if(offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+        fprintf(out, "   | ");
+    } else {
+        fprintf(out, "%4d ", chunk->lines[offset]);
+    }
+
+    uint32_t instruction = chunk->code[offset];
+    switch (REG_OP(instruction)) {
+        case ROP_LOADK:
+            fprintf(out, "%-16s r%d,", "LOADK", REG_A(instruction));
+            regOperand(out, chunk, true, REG_BX(instruction));
+            fprintf(out, "\n");
+            return offset + 1;
+        case ROP_LOADKX:
+            fprintf(out, "%-16s r%d,", "LOADKX", REG_A(instruction));
+            regOperand(out, chunk, true, (int)chunk->code[offset + 1]);
+            fprintf(out, "\n");
+            return offset + 2;
+        case ROP_NEGATE:
+            fprintf(out, "%-16s r%d, r%d\n", "NEGATE", REG_A(instruction), REG_B(instruction));
+            return offset + 1;
+        case ROP_ADD_RR:
+        case ROP_ADD_RK:
+        case ROP_ADD_KR:
+            return regArithmeticInstruction(out, "ADD", chunk, offset);
+        case ROP_SUBTRACT_RR:
+        case ROP_SUBTRACT_RK:
+        case ROP_SUBTRACT_KR:
+            return regArithmeticInstruction(out, "SUBTRACT", chunk, offset);
+        case ROP_MULTIPLY_RR:
+        case ROP_MULTIPLY_RK:
+        case ROP_MULTIPLY_KR:
+            return regArithmeticInstruction(out, "MULTIPLY", chunk, offset);
+        case ROP_DIVIDE_RR:
+        case ROP_DIVIDE_RK:
+        case ROP_DIVIDE_KR:
+            return regArithmeticInstruction(out, "DIVIDE", chunk, offset);
+        case ROP_RETURN:
+            fprintf(out, "%-16s r%d\n", "RETURN", REG_A(instruction));
+            return offset + 1;
+        case ROP_LOADPARAM:
+            fprintf(out, "%-16s r%d, p%d\n", "LOADPARAM", REG_A(instruction), REG_B(instruction));
+            return offset + 1;
         default:
-            printf("Unknown opcode %d\n", instruction);
+            fprintf(out, "Unknown register opcode %d\n", REG_OP(instruction));
             return offset + 1;
     }
 }
\ No newline at end of file
@@ -1,9 +1,15 @@
 #ifndef CLOX_DEBUG_H
 #define CLOX_DEBUG_H
 
+#include <stdio.h>
+
 #include "chunk.h"
+#include "regchunk.h"
 
-void disassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+void disassembleChunk(FILE* out, Chunk* chunk, const char* name);
+int disassembleInstruction(FILE* out, Chunk* chunk, int offset);
+const char* opcodeName(uint8_t opcode);
+void disassembleRegChunk(FILE* out, RegChunk* chunk, const char* name);
+int disassembleRegInstruction(FILE* out, RegChunk* chunk, int offset);
 
 #endif //CLOX_DEBUG_H
@@ -0,0 +1,243 @@
+#include <math.h>
+#include <string.h>
+
+#include "graph.h"
+
+#define GRAPH_BLOCK_SIZE (16 * 1024)
+
+/**
+ * Sets up an empty graph.
+ * @param graph the graph to initialize
+ * @param fastMath whether rewrites which are not bit for bit exact are allowed
+ */
+void initGraph(ExprGraph* graph, bool fastMath) {
+    initArena(&graph->arena, &heapAllocator, GRAPH_BLOCK_SIZE);
+    graph->fastMath = fastMath;
+    graph->buckets = NULL;
+    graph->bucketCount = 0;
+    graph->nodes = NULL;
+    graph->nodeCount = 0;
+    graph->nodeCapacity = 0;
+}
+
+void freeGraph(ExprGraph* graph) {
+    freeArena(&graph->arena);
+    initGraph(graph, graph->fastMath);
+}
+
+static uint64_t numberBits(double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    return bits;
+}
+
+/**
+ * Hashes everything that makes a node what it is. Operands are hashed by id, which is enough as
+ * equal operands are always the same node.
+ * @param node the node to hash
+ * @return the hash of the node
+ */
+static uint32_t hashNode(ExprNode* node) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t parts[] = {(uint64_t)node->type, numberBits(node->number), (uint64_t)node->param,
+                        node->left != NULL ? (uint64_t)node->left->id + 1 : 0,
+                        node->right != NULL ? (uint64_t)node->right->id + 1 : 0};
+    for(size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        hash = (hash ^ parts[i]) * 1099511628211ULL;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static bool nodesEqual(ExprNode* a, ExprNode* b) {
+    return a->type == b->type && numberBits(a->number) == numberBits(b->number) && a->param == b->param &&
+           a->left == b->left && a->right == b->right;
+}
+
+/**
+ * Doubles the number of hash buckets and moves every node over. The old buckets stay behind in the
+ * arena until the graph is freed.
+ * @param graph the graph whose table is full
+ */
+static void growBuckets(ExprGraph* graph) {
+    int count = GROW_CAPACITY(graph->bucketCount);
+    ExprNode** buckets = GROW_ARRAY(&graph->arena.allocator, MEMORY_VM, ExprNode*, NULL, 0, count);
+    memset(buckets, 0, sizeof(ExprNode*) * count);
+    for(int i = 0; i < graph->nodeCount; i++) {
+        ExprNode* node = graph->nodes[i];
+        ExprNode** bucket = &buckets[node->hash & (uint32_t)(count - 1)];
+        node->next = *bucket;
+        *bucket = node;
+    }
+    graph->buckets = buckets;
+    graph->bucketCount = count;
+}
+
+/**
+ * Returns the node equal to the given one, creating it if the graph does not have it yet.
+ * @param graph the graph to look in
+ * @param key the node wanted, only its type, number, param and operands are looked at
+ * @return the node in the graph
+ */
+static ExprNode* intern(ExprGraph* graph, ExprNode key) {
+    key.hash = hashNode(&key);
+    if(graph->bucketCount > 0) {
+        for(ExprNode* node = graph->buckets[key.hash & (uint32_t)(graph->bucketCount - 1)];
+            node != NULL; node = node->next) {
+            if(node->hash == key.hash && nodesEqual(node, &key)) return node;
+        }
+    }
+
+    if(graph->nodeCapacity < graph->nodeCount + 1) {
+        int oldCapacity = graph->nodeCapacity;
+        graph->nodeCapacity = GROW_CAPACITY(oldCapacity);
+        graph->nodes = GROW_ARRAY(&graph->arena.allocator, MEMORY_VM, ExprNode*, graph->nodes,
+                                  oldCapacity, graph->nodeCapacity);
+    }
+    ExprNode* node = GROW_ARRAY(&graph->arena.allocator, MEMORY_VM, ExprNode, NULL, 0, 1);
+    *node = key;
+    node->id = graph->nodeCount;
+    node->uses = 0;
+    node->local = -1;
+    graph->nodes[graph->nodeCount++] = node;
+
+    if(graph->nodeCount > graph->bucketCount) {
+        growBuckets(graph);
+    } else {
+        ExprNode** bucket = &graph->buckets[node->hash & (uint32_t)(graph->bucketCount - 1)];
+        node->next = *bucket;
+        *bucket = node;
+    }
+    return node;
+}
+
+static ExprNode* makeNode(ExprGraph* graph, NodeType type, ExprNode* left, ExprNode* right, int line) {
+    return intern(graph, (ExprNode){.type = type, .line = line, .left = left, .right = right});
+}
+
+ExprNode* graphConstant(ExprGraph* graph, double number, int line) {
+    return intern(graph, (ExprNode){.type = NODE_CONSTANT, .line = line, .number = number});
+}
+
+ExprNode* graphParam(ExprGraph* graph, int param, int line) {
+    return intern(graph, (ExprNode){.type = NODE_PARAM, .line = line, .param = param});
+}
+
+/**
+ * Negates a node. Constants are folded and a double negation cancels out, both of which give the
+ * same bits the VM would.
+ * @param graph the graph to add to
+ * @param operand the node to negate, NULL after a parse error
+ * @param line the line of the operator
+ * @return the negated node, NULL if the operand was
+ */
+ExprNode* graphNegate(ExprGraph* graph, ExprNode* operand, int line) {
+    if(operand == NULL) return NULL;
+    if(operand->type == NODE_CONSTANT) return graphConstant(graph, -operand->number, line);
+    if(operand->type == NODE_NEGATE) return operand->left;
+    return makeNode(graph, NODE_NEGATE, operand, NULL, line);
+}
+
+static bool isCommutative(NodeType type) {
+    return type == NODE_ADD || type == NODE_MULTIPLY;
+}
+
+static double fold(NodeType type, double a, double b) {
+    switch(type) {
+        case NODE_ADD: return a + b;
+        case NODE_SUBTRACT: return a - b;
+        case NODE_MULTIPLY: return a * b;
+        default: return a / b;
+    }
+}
+
+/**
+ * Whether a number has a reciprocal which is finite and not zero, so that multiplying by it is at
+ * least close to dividing by the number.
+ * @param number the divisor
+ * @return true if 1 / number is a usable multiplier
+ */
+static bool hasReciprocal(double number) {
+    double reciprocal = 1.0 / number;
+    return isfinite(reciprocal) && reciprocal != 0.0;
+}
+
+/**
+ * Applies the fast-math rewrites to a binary node which is about to be created. Subtracting a
+ * constant becomes adding its negation and dividing becomes multiplying by a reciprocal, so that
+ * chains of either can be reassociated to gather their constants into one. A reciprocal of
+ * something other than a constant is a node of its own, which every division by the same divisor
+ * shares.
+ * @param graph the graph to add to
+ * @param type the operator
+ * @param left the left operand
+ * @param right the right operand
+ * @param line the line of the operator
+ * @return the rewritten node, or NULL if none of the rewrites apply
+ */
+static ExprNode* fastMathBinary(ExprGraph* graph, NodeType type, ExprNode* left, ExprNode* right, int line) {
+    bool rightConstant = right->type == NODE_CONSTANT;
+    if(type == NODE_SUBTRACT && rightConstant) {
+        return graphBinary(graph, NODE_ADD, left, graphConstant(graph, -right->number, line), line);
+    }
+    if(type == NODE_DIVIDE && rightConstant && hasReciprocal(right->number)) {
+        return graphBinary(graph, NODE_MULTIPLY, left, graphConstant(graph, 1.0 / right->number, line), line);
+    }
+    if(type == NODE_DIVIDE && !rightConstant) {
+        ExprNode* reciprocal = makeNode(graph, NODE_DIVIDE, graphConstant(graph, 1.0, line), right, line);
+        return graphBinary(graph, NODE_MULTIPLY, left, reciprocal, line);
+    }
+    if(!isCommutative(type)) return NULL;
+
+    // Constants go right and other operands in id order, so a + b and b + a are the same node.
+    if(left->type == NODE_CONSTANT || (!rightConstant && left->id > right->id)) {
+        return graphBinary(graph, type, right, left, line);
+    }
+    if(rightConstant && left->type == type && left->right->type == NODE_CONSTANT) {
+        double constant = fold(type, left->right->number, right->number);
+        return graphBinary(graph, type, left->left, graphConstant(graph, constant, line), line);
+    }
+    if(rightConstant && right->number == (type == NODE_ADD ? 0.0 : 1.0)) return left;
+    return NULL;
+}
+
+/**
+ * Combines two nodes with a binary operator. Operators on two constants are folded the same way
+ * the VM would compute them, and in fast-math mode the rewrites of fastMathBinary() are applied.
+ * @param graph the graph to add to
+ * @param type the operator, one of the binary node types
+ * @param left the left operand, NULL after a parse error
+ * @param right the right operand, NULL after a parse error
+ * @param line the line of the operator
+ * @return the node for the operation, NULL if an operand was
+ */
+ExprNode* graphBinary(ExprGraph* graph, NodeType type, ExprNode* left, ExprNode* right, int line) {
+    if(left == NULL || right == NULL) return NULL;
+    if(left->type == NODE_CONSTANT && right->type == NODE_CONSTANT) {
+        return graphConstant(graph, fold(type, left->number, right->number), line);
+    }
+    if(graph->fastMath) {
+        ExprNode* rewritten = fastMathBinary(graph, type, left, right, line);
+        if(rewritten != NULL) return rewritten;
+    }
+    return makeNode(graph, type, left, right, line);
+}
+
+static void visit(ExprNode* node) {
+    node->uses++;
+    if(node->uses > 1) return;
+    if(node->left != NULL) visit(node->left);
+    if(node->right != NULL) visit(node->right);
+}
+
+/**
+ * Counts how often every node is used by the expression, each parent counting once. Nodes which
+ * were only needed on the way, such as operands of folded constants, end up with no uses.
+ * @param graph the graph
+ * @param root the node of the whole expression
+ */
+void countUses(ExprGraph* graph, ExprNode* root) {
+    for(int i = 0; i < graph->nodeCount; i++) {
+        graph->nodes[i]->uses = 0;
+    }
+    visit(root);
+}
@@ -0,0 +1,68 @@
+#ifndef CLOX_GRAPH_H
+#define CLOX_GRAPH_H
+
+#include "common.h"
+#include "memory.h"
+
+typedef enum {
+    NODE_CONSTANT,
+    NODE_PARAM,
+    NODE_NEGATE,
+    NODE_ADD,
+    NODE_SUBTRACT,
+    NODE_MULTIPLY,
+    NODE_DIVIDE
+} NodeType;
+
+typedef struct ExprNode ExprNode;
+
+/*
+ * A node of an expression graph. Nodes are hash-consed: asking for a node equal to one which
+ * already exists returns that node, so a subexpression which appears several times is a single
+ * node with several parents.
+ */
+struct ExprNode {
+    NodeType type;
+    // The line of the first occurrence, which errors in the node are reported at.
+    int line;
+    // Nodes are numbered as they are created, so operands always come before their users.
+    int id;
+    double number;
+    int param;
+    // The operands of a binary node. A negation only has a left operand.
+    ExprNode* left;
+    ExprNode* right;
+    uint32_t hash;
+    ExprNode* next;
+    // How many times the node is used by the expression, filled in by countUses().
+    int uses;
+    // The stack slot the lowered node is kept in, or -1 if it is computed where it is used.
+    int local;
+};
+
+/*
+ * An expression as a DAG. Every node lives in the graph's arena, so the whole graph is released at
+ * once when the expression has been lowered to bytecode.
+ */
+typedef struct {
+    Arena arena;
+    // Allows rewrites which change results in the last bits: reassociation and multiplying by a
+    // reciprocal instead of dividing.
+    bool fastMath;
+    ExprNode** buckets;
+    int bucketCount;
+    // Every node by id.
+    ExprNode** nodes;
+    int nodeCount;
+    int nodeCapacity;
+} ExprGraph;
+
+void initGraph(ExprGraph* graph, bool fastMath);
+void freeGraph(ExprGraph* graph);
+ExprNode* graphConstant(ExprGraph* graph, double number, int line);
+ExprNode* graphParam(ExprGraph* graph, int param, int line);
+ExprNode* graphNegate(ExprGraph* graph, ExprNode* operand, int line);
+ExprNode* graphBinary(ExprGraph* graph, NodeType type, ExprNode* left, ExprNode* right, int line);
+void countUses(ExprGraph* graph, ExprNode* root);
+
+#endif //CLOX_GRAPH_H
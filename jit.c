@@ -0,0 +1,316 @@
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+
+#ifdef X86_64_JIT
+
+/*
+ * A template JIT: every instruction is translated on its own into a fixed sequence of SSE2
+ * instructions. The stack depth at every instruction is known while translating, so each stack slot
+ * is given a fixed place: the first SLOT_REGISTERS slots live in xmm0 upwards and deeper slots in
+ * the spill array, whose address is the second argument (rsi). Parameters are read through the
+ * first argument (rdi). The two registers above the slots are scratch.
+ *
+ * Every operation is the same SSE2 instruction the C compiler uses for the interpreter, so results
+ * are the same bit for bit. The one exception is which NaN comes out of an operation on two NaNs,
+ * which depends on the order of the operands: the JIT always operates on the left one, while the
+ * C compiler may swap the operands of + and *.
+ */
+#define SLOT_REGISTERS 14
+#define SCRATCH_CONSTANT 14
+#define SCRATCH 15
+
+#define REG_RSI 6
+#define REG_RDI 7
+
+// The largest stack whose spill slots can be addressed with a 32 bit displacement.
+#define MAX_NATIVE_STACK (INT32_MAX / 8)
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+} Assembler;
+
+/*
+ * Where a value is: an xmm register, or a double at base + displacement in memory.
+ */
+typedef struct {
+    bool memory;
+    int reg;
+    int base;
+    int32_t displacement;
+} Location;
+
+static void emitByte(Assembler* assembler, uint8_t byte) {
+    if(assembler->capacity < assembler->count + 1) {
+        int oldCapacity = assembler->capacity;
+        assembler->capacity = GROW_CAPACITY(oldCapacity);
+        assembler->code = GROW_ARRAY(&heapAllocator, MEMORY_BYTECODE, uint8_t, assembler->code, oldCapacity,
+                                     assembler->capacity);
+    }
+    assembler->code[assembler->count++] = byte;
+}
+
+static void emitBytes(Assembler* assembler, uint64_t value, int count) {
+    for(int i = 0; i < count; i++) {
+        emitByte(assembler, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static Location xmm(int reg) {
+    return (Location){false, reg, 0, 0};
+}
+
+static Location slot(int index) {
+    if(index < SLOT_REGISTERS) return xmm(index);
+    return (Location){true, 0, REG_RSI, index * 8};
+}
+
+static Location param(int index) {
+    return (Location){true, 0, REG_RDI, index * 8};
+}
+
+/**
+ * Emits an SSE instruction of the form prefix 0F opcode with an xmm register and a register or
+ * memory operand. The memory operands are always rsi or rdi plus a 32 bit displacement, neither of
+ * which needs a SIB byte.
+ * @param assembler the code to add to
+ * @param prefix the mandatory prefix, 0x66 or 0xf2
+ * @param opcode the byte after 0F
+ * @param reg the xmm register in the reg field
+ * @param operand the operand in the r/m field
+ */
+static void emitSse(Assembler* assembler, uint8_t prefix, uint8_t opcode, int reg, Location operand) {
+    emitByte(assembler, prefix);
+    uint8_t rex = (uint8_t)(0x40 | ((reg >> 3) << 2) | (operand.memory ? 0 : operand.reg >> 3));
+    if(rex != 0x40) emitByte(assembler, rex);
+    emitByte(assembler, 0x0f);
+    emitByte(assembler, opcode);
+    if(operand.memory) {
+        emitByte(assembler, (uint8_t)(0x80 | ((reg & 7) << 3) | operand.base));
+        emitBytes(assembler, (uint32_t)operand.displacement, 4);
+    } else {
+        emitByte(assembler, (uint8_t)(0xc0 | ((reg & 7) << 3) | (operand.reg & 7)));
+    }
+}
+
+/**
+ * Copies a double from one location to another, going through the scratch register when both are
+ * in memory.
+ */
+static void emitMove(Assembler* assembler, Location to, Location from) {
+    if(!to.memory && !from.memory) {
+        if(to.reg != from.reg) emitSse(assembler, 0x66, 0x28, to.reg, from); // movapd
+    } else if(!to.memory) {
+        emitSse(assembler, 0xf2, 0x10, to.reg, from); // movsd load
+    } else if(!from.memory) {
+        emitSse(assembler, 0xf2, 0x11, from.reg, to); // movsd store
+    } else {
+        emitSse(assembler, 0xf2, 0x10, SCRATCH, from);
+        emitSse(assembler, 0xf2, 0x11, SCRATCH, to);
+    }
+}
+
+/**
+ * Puts the bits of a double into a location through rax.
+ */
+static void emitNumber(Assembler* assembler, Location to, double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    if(bits == 0 && !to.memory) {
+        emitSse(assembler, 0x66, 0x57, to.reg, to); // xorpd
+        return;
+    }
+
+    emitByte(assembler, 0x48); // mov rax, imm64
+    emitByte(assembler, 0xb8);
+    emitBytes(assembler, bits, 8);
+    if(to.memory) {
+        emitByte(assembler, 0x48); // mov [base + displacement], rax
+        emitByte(assembler, 0x89);
+        emitByte(assembler, (uint8_t)(0x80 | to.base));
+        emitBytes(assembler, (uint32_t)to.displacement, 4);
+    } else {
+        emitByte(assembler, 0x66); // movq xmm, rax
+        emitByte(assembler, (uint8_t)(0x48 | ((to.reg >> 3) << 2)));
+        emitByte(assembler, 0x0f);
+        emitByte(assembler, 0x6e);
+        emitByte(assembler, (uint8_t)(0xc0 | ((to.reg & 7) << 3)));
+    }
+}
+
+/**
+ * Emits left = left op right for a scalar SSE operation. A left operand in memory is loaded into
+ * the scratch register, operated on there and stored back.
+ * @param assembler the code to add to
+ * @param prefix the mandatory prefix of the operation
+ * @param opcode the operation, one of the addsd, subsd, mulsd, divsd and xorpd opcodes
+ * @param left the left operand, which receives the result
+ * @param right the right operand, which must not be in memory for xorpd
+ */
+static void emitOperation(Assembler* assembler, uint8_t prefix, uint8_t opcode, Location left, Location right) {
+    if(!left.memory) {
+        emitSse(assembler, prefix, opcode, left.reg, right);
+        return;
+    }
+    emitMove(assembler, xmm(SCRATCH), left);
+    emitSse(assembler, prefix, opcode, SCRATCH, right);
+    emitMove(assembler, left, xmm(SCRATCH));
+}
+
+static uint8_t sseOpcode(uint8_t op) {
+    switch(op) {
+        case OP_ADD:
+        case OP_ADD_CONSTANT: return 0x58;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_CONSTANT: return 0x59;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_CONSTANT: return 0x5c;
+        default: return 0x5e;
+    }
+}
+
+/**
+ * Looks up a constant the JIT can put into the code. The interpreter checks that operands are
+ * numbers when it runs; the JIT only takes chunks whose constants all are, so it never has to.
+ * @param chunk the chunk
+ * @param index the index of the constant
+ * @param number set to the number
+ * @return true if the constant is a number
+ */
+static bool numberConstant(Chunk* chunk, int index, double* number) {
+    Value value = chunk->constants.values[index];
+    if(!IS_NUMBER(value)) return false;
+    *number = AS_NUMBER(value);
+    return true;
+}
+
+/**
+ * Translates the bytecode of a chunk into machine code.
+ * @param chunk the chunk to translate
+ * @param assembler receives the code
+ * @param usesParams set when the code reads parameters
+ * @return false if the chunk has something the JIT does not translate
+ */
+static bool translate(Chunk* chunk, Assembler* assembler, bool* usesParams) {
+    uint8_t* code = chunk->code;
+    int top = 0;
+    double number;
+    for(int offset = 0; offset < chunk->count;) {
+        uint8_t op = code[offset];
+        switch(op) {
+            case OP_CONSTANT:
+                if(!numberConstant(chunk, code[offset + 1], &number)) return false;
+                emitNumber(assembler, slot(top++), number);
+                offset += 2;
+                break;
+            case OP_CONSTANT_LONG:
+                if(!numberConstant(chunk, code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16),
+                                   &number)) {
+                    return false;
+                }
+                emitNumber(assembler, slot(top++), number);
+                offset += 4;
+                break;
+            case OP_CONSTANT_CONSTANT:
+                for(int i = 1; i <= 2; i++) {
+                    if(!numberConstant(chunk, code[offset + i], &number)) return false;
+                    emitNumber(assembler, slot(top++), number);
+                }
+                offset += 3;
+                break;
+            case OP_GET_PARAM:
+                *usesParams = true;
+                emitMove(assembler, slot(top++), param(code[offset + 1]));
+                offset += 2;
+                break;
+            case OP_GET_LOCAL:
+                emitMove(assembler, slot(top++), slot(code[offset + 1]));
+                offset += 2;
+                break;
+            case OP_NEGATE:
+                // Flipping the sign bit is what the C compiler does for -x as well, NaN included.
+                emitNumber(assembler, xmm(SCRATCH_CONSTANT), -0.0);
+                emitOperation(assembler, 0x66, 0x57, slot(top - 1), xmm(SCRATCH_CONSTANT));
+                offset += 1;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                emitOperation(assembler, 0xf2, sseOpcode(op), slot(top - 2), slot(top - 1));
+                top--;
+                offset += 1;
+                break;
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT:
+                if(!numberConstant(chunk, code[offset + 1], &number)) return false;
+                emitNumber(assembler, xmm(SCRATCH_CONSTANT), number);
+                emitOperation(assembler, 0xf2, sseOpcode(op), slot(top - 1), xmm(SCRATCH_CONSTANT));
+                offset += 2;
+                break;
+            case OP_RETURN:
+                emitMove(assembler, xmm(0), slot(top - 1));
+                emitByte(assembler, 0xc3); // ret
+                return true;
+            default:
+                return false;
+        }
+    }
+    // Code which runs off its end is not something the compiler makes.
+    return false;
+}
+
+/**
+ * Compiles a chunk to machine code. The code is written to fresh pages which are then made
+ * executable and read-only, so no page is ever writable and executable at once.
+ * @param chunk the chunk to compile
+ * @return the compiled code, whose function is NULL if the chunk could not be compiled
+ */
+NativeCode* compileNative(Chunk* chunk) {
+    NativeCode* native = GROW_ARRAY(&heapAllocator, MEMORY_BYTECODE, NativeCode, NULL, 0, 1);
+    *native = (NativeCode){NULL, NULL, 0, false};
+    if(chunk->maxStack > MAX_NATIVE_STACK) return native;
+
+    Assembler assembler = {NULL, 0, 0};
+    if(translate(chunk, &assembler, &native->usesParams)) {
+        void* code = mmap(NULL, (size_t)assembler.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(code != MAP_FAILED) {
+            memcpy(code, assembler.code, (size_t)assembler.count);
+            if(mprotect(code, (size_t)assembler.count, PROT_READ | PROT_EXEC) == 0) {
+                native->code = code;
+                native->size = (size_t)assembler.count;
+                native->function = (NativeFunction)code;
+            } else {
+                munmap(code, (size_t)assembler.count);
+            }
+        }
+    }
+    FREE_ARRAY(&heapAllocator, MEMORY_BYTECODE, uint8_t, assembler.code, assembler.capacity);
+    return native;
+}
+
+#else
+
+NativeCode* compileNative(Chunk* chunk) {
+    (void)chunk;
+    NativeCode* native = GROW_ARRAY(&heapAllocator, MEMORY_BYTECODE, NativeCode, NULL, 0, 1);
+    *native = (NativeCode){NULL, NULL, 0, false};
+    return native;
+}
+
+#endif
+
+/**
+ * Unmaps the machine code and frees what describes it.
+ * @param native the code to free, or NULL
+ */
+void freeNativeCode(NativeCode* native) {
+    if(native == NULL) return;
+    if(native->code != NULL) munmap(native->code, native->size);
+    FREE_ARRAY(&heapAllocator, MEMORY_BYTECODE, NativeCode, native, 1);
+}
@@ -0,0 +1,28 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "chunk.h"
+
+/*
+ * The signature of a chunk compiled to machine code. It returns the value of the expression and
+ * keeps the stack slots that do not fit in registers in spill, which needs room for a double per
+ * slot of the chunk's maxStack.
+ */
+typedef double (*NativeFunction)(const double* params, double* spill);
+
+/*
+ * Machine code made from a chunk. A chunk the JIT cannot translate still gets one, with no
+ * function, so that it is not tried again on every run.
+ */
+struct NativeCode {
+    NativeFunction function;
+    void* code;
+    size_t size;
+    // Whether the code reads parameters, in which case it must not be called without them.
+    bool usesParams;
+};
+
+NativeCode* compileNative(Chunk* chunk);
+void freeNativeCode(NativeCode* native);
+
+#endif //CLOX_JIT_H
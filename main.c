@@ -1,97 +1,379 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "aot.h"
+#include "cache.h"
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
 #include "compiler.h"
+#include "runner.h"
+#include "source.h"
+#include "trace.h"
 
-static char* readFile(const char* path);
-static void repl();
-static void runFile(const char* path);
+static void repl(VM* vm, Backend backend);
+static int runFile(VM* vm, const char* path, Backend backend, bool useCache, bool useGraph, bool fastMath);
+static int runStream(VM* vm, const char* path, Backend backend);
+static void writeProfile(Profile* profile, bool text, const char* jsonPath);
+static int runFiles(const char* paths[], int count, int threadCount, Backend backend);
+static int emitFiles(const char* paths[], int count, const char* cPath, const char* libraryPath);
 
 
 int main(int argc, const char* argv[]) {
-    initVM();
-
-    char* buffer = readFile("test.clox");
-    interpret(buffer);
+    Backend backend = BACKEND_STACK;
+    bool useCache = true;
+    bool stream = false;
+    bool memStats = false;
+    bool optimize = false;
+    bool optimizerStats = false;
+    bool useGraph = false;
+    bool fastMath = false;
+    bool jit = false;
+    const char* emitPath = NULL;
+    const char* buildPath = NULL;
+    const char* aotPath = NULL;
+    int threadCount = 0;
+    bool profileText = false;
+    const char* profileJson = NULL;
+    bool disassemble = false;
+    bool trace = false;
+    const char* traceFile = NULL;
+    long traceRingSize = 0;
+    const char** paths = malloc(sizeof(const char*) * argc);
+    int pathCount = 0;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--register") == 0) {
+            backend = BACKEND_REGISTER;
+        } else if(strcmp(argv[i], "--no-cache") == 0) {
+            useCache = false;
+        } else if(strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if(strcmp(argv[i], "--mem-stats") == 0) {
+            memStats = true;
+        } else if(strcmp(argv[i], "--optimize") == 0) {
+            optimize = true;
+        } else if(strcmp(argv[i], "--opt-stats") == 0) {
+            optimize = true;
+            optimizerStats = true;
+        } else if(strcmp(argv[i], "--cse") == 0) {
+            useGraph = true;
+        } else if(strcmp(argv[i], "--fast-math") == 0) {
+            useGraph = true;
+            fastMath = true;
+        } else if(strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+        } else if(strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+            emitPath = argv[++i];
+        } else if(strcmp(argv[i], "--build") == 0 && i + 1 < argc) {
+            buildPath = argv[++i];
+        } else if(strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+            aotPath = argv[++i];
+        } else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threadCount = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--profile") == 0) {
+            profileText = true;
+        } else if(strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc) {
+            profileJson = argv[++i];
+        } else if(strcmp(argv[i], "--disassemble") == 0) {
+            disassemble = true;
+        } else if(strcmp(argv[i], "--trace") == 0) {
+            trace = true;
+        } else if(strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            trace = true;
+            traceFile = argv[++i];
+        } else if(strcmp(argv[i], "--trace-ring") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            trace = true;
+            traceRingSize = atol(argv[++i]);
+        } else if(argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
+            paths[pathCount++] = argv[i];
+        } else {
+            fprintf(stderr, "Usage: clox [--register] [--no-cache] [--stream] [--mem-stats] [--threads n] "
+                            "[--optimize] [--opt-stats] [--cse] [--fast-math] [--jit] [--emit-c file] [--build library] [--aot library] [--profile] [--profile-json file] "
+                            "[--disassemble] [--trace] [--trace-file file] [--trace-ring bytes] [path...]\n");
+            exit(64);
+        }
+    }
 
-    freeVM();
-    return 0;
-}
+    if(emitPath != NULL || buildPath != NULL) {
+        if(emitPath == NULL || pathCount == 0) {
+            fprintf(stderr, "--emit-c needs the scripts to translate, and --build needs --emit-c.\n");
+            exit(64);
+        }
+        int exitCode = emitFiles(paths, pathCount, emitPath, buildPath);
+        free(paths);
+        return exitCode;
+    }
 
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
+    bool profiling = profileText || profileJson != NULL;
+    if(profiling && (backend == BACKEND_REGISTER || pathCount > 1 || threadCount > 0)) {
+        fprintf(stderr, "Profiling is only supported for a single VM on the stack backend.\n");
+        exit(64);
+    }
+    if((trace || disassemble) && (profiling || pathCount > 1 || threadCount > 0)) {
+        fprintf(stderr, "Tracing is only supported for a single VM without profiling.\n");
+        exit(64);
+    }
 
-    if(file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+    if(optimize && (pathCount > 1 || threadCount > 0)) {
+        fprintf(stderr, "Optimization is only supported for a single VM.\n");
+        exit(64);
+    }
+    if(jit && (backend == BACKEND_REGISTER || pathCount > 1 || threadCount > 0)) {
+        fprintf(stderr, "The JIT is only supported for a single VM on the stack backend.\n");
+        exit(64);
     }
+    if(aotPath != NULL &&
+       (pathCount > 1 || threadCount > 0 || stream || (pathCount == 1 && strcmp(paths[0], "-") == 0))) {
+        fprintf(stderr, "An AOT library is only supported for a single script file or the REPL.\n");
+        exit(64);
+    }
+    if(useGraph && (pathCount != 1 || threadCount > 0 || stream || strcmp(paths[0], "-") == 0)) {
+        fprintf(stderr, "--cse and --fast-math are only supported for a single script file.\n");
+        exit(64);
+    }
+    // The library's functions were compiled without the graph, so they would silently ignore it.
+    if(aotPath != NULL && useGraph) {
+        fprintf(stderr, "--cse and --fast-math are not supported with an AOT library.\n");
+        exit(64);
+    }
+    // Cached chunks are mapped read-only and were compiled without the passes or the graph.
+    if(optimize || useGraph) useCache = false;
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+    if(memStats) enableMemoryStats();
 
-    char* buffer = (char*)malloc(fileSize + 1);
-    if(buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+    if(pathCount > 1 || threadCount > 0) {
+        int exitCode = runFiles(paths, pathCount, threadCount > 0 ? threadCount : 1, backend);
+        if(memStats) writeMemoryStats(stderr);
+        free(paths);
+        return exitCode;
     }
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if(bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+    VM vm;
+    initVM(&vm);
+    Profile profile;
+    if(profiling) {
+        initProfile(&profile);
+        vm.profile = &profile;
     }
 
-    buffer[bytesRead] = '\0';
+    FILE* traceOut = stdout;
+    TraceRing ring;
+    if(traceRingSize > 0) {
+        if(!openTraceRing(&ring, (size_t)traceRingSize)) {
+            fprintf(stderr, "Could not create a trace ring buffer.\n");
+            exit(74);
+        }
+        traceOut = ring.file;
+    } else if(traceFile != NULL) {
+        traceOut = fopen(traceFile, "w");
+        if(traceOut == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", traceFile);
+            exit(74);
+        }
+    }
+    OptimizerStats optimizerCounts;
+    if(optimize) {
+        initOptimizerStats(&optimizerCounts);
+        vm.optimizer = &optimizerCounts;
+    }
+    // A script runs once, so there is no point waiting for it to get hot.
+    if(jit) vm.jitThreshold = 1;
+    AotLibrary library;
+    if(aotPath != NULL) {
+        if(!loadLibrary(&library, aotPath)) exit(74);
+        vm.aot = &library;
+    }
+    if(trace) vm.trace = traceOut;
+    if(disassemble) vm.disassembly = traceOut;
+
+    int exitCode = 0;
+    if(pathCount == 0) {
+        repl(&vm, backend);
+    } else if(stream || strcmp(paths[0], "-") == 0) {
+        exitCode = runStream(&vm, paths[0], backend);
+    } else {
+        exitCode = runFile(&vm, paths[0], backend, useCache, useGraph, fastMath);
+    }
 
-    fclose(file);
-    return buffer;
+    if(optimizerStats) writeOptimizerStats(&optimizerCounts, stderr);
+    if(aotPath != NULL) freeLibrary(&library);
+    if(profiling) {
+        writeProfile(&profile, profileText, profileJson);
+        freeProfile(&profile);
+    }
+    if(traceRingSize > 0) {
+        dumpTraceRing(&ring, stderr);
+        closeTraceRing(&ring);
+    } else if(traceFile != NULL) {
+        fclose(traceOut);
+    }
+    freeVM(&vm);
+    if(memStats) writeMemoryStats(stderr);
+    free(paths);
+    return exitCode;
 }
 
-static void repl() {
-    char line[1024];
+static void repl(VM* vm, Backend backend) {
+    char* line = NULL;
+    size_t capacity = 0;
     for(;;) {
         printf("> ");
 
-        if(!fgets(line, sizeof(line), stdin)) {
+        if(getline(&line, &capacity, stdin) < 0) {
             printf("\n");
             break;
         }
 
-        interpret(line);
+        interpret(vm, line, backend);
     }
+    free(line);
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
-
-    if(result == INTERPREET_COMPILE_ERROR) exit(65);
-    if(result == INTERPREET_RUNTIME_ERROR) exit(70);
-}
-
-
-
-
-
-
-
+static int runFile(VM* vm, const char* path, Backend backend, bool useCache, bool useGraph, bool fastMath) {
+    Source source;
+    if(!loadSource(&source, path)) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
 
+    // The library finds expressions by their source text, which is what interpret() looks up.
+    if(vm->aot != NULL) {
+        InterpretResult result = interpret(vm, source.text, backend);
+        freeSource(&source);
+        return result == INTERPREET_COMPILE_ERROR ? 65 : result == INTERPREET_RUNTIME_ERROR ? 70 : 0;
+    }
 
+    Chunk chunk;
+    initChunk(&chunk);
+    bool compiled;
+    if(useGraph) {
+        compiled = compileGraph(source.text, source.length, &chunk, NULL, 0, fastMath);
+    } else {
+        compiled = useCache ? compileCached(source.text, source.length, &chunk)
+                            : compile(source.text, source.length, &chunk);
+    }
+    if(compiled && vm->optimizer != NULL) optimizeChunk(&chunk, vm->optimizer);
+    InterpretResult result = compiled ? interpretChunk(vm, &chunk, backend) : INTERPREET_COMPILE_ERROR;
+    freeChunk(&chunk);
+    freeSource(&source);
 
+    if(result == INTERPREET_COMPILE_ERROR) return 65;
+    if(result == INTERPREET_RUNTIME_ERROR) return 70;
+    return 0;
+}
 
+/**
+ * Compiles a script while it is read, without ever holding all of its source in memory. Piped
+ * scripts can only be run this way. The cache is skipped as it is keyed on the whole source.
+ * @param vm the VM to run the script on
+ * @param path the path of the script, or "-" for standard input
+ * @param backend the backend to run the compiled chunk on
+ * @return the exit code for the result
+ */
+static int runStream(VM* vm, const char* path, Backend backend) {
+    bool isStdin = strcmp(path, "-") == 0;
+    FILE* file = isStdin ? stdin : fopen(path, "rb");
+    if(file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
 
+    Chunk chunk;
+    initChunk(&chunk);
+    InterpretResult result = INTERPREET_COMPILE_ERROR;
+    if(compileStream(file, &chunk)) {
+        if(vm->optimizer != NULL) optimizeChunk(&chunk, vm->optimizer);
+        result = interpretChunk(vm, &chunk, backend);
+    }
+    freeChunk(&chunk);
+    if(!isStdin) fclose(file);
 
+    if(result == INTERPREET_COMPILE_ERROR) return 65;
+    if(result == INTERPREET_RUNTIME_ERROR) return 70;
+    return 0;
+}
 
+static int runFiles(const char* paths[], int count, int threadCount, Backend backend) {
+    Job* jobs = malloc(sizeof(Job) * count);
+    Source* sources = malloc(sizeof(Source) * count);
+    for(int i = 0; i < count; i++) {
+        if(!loadSource(&sources[i], paths[i])) {
+            fprintf(stderr, "Could not read file \"%s\".\n", paths[i]);
+            exit(74);
+        }
+        jobs[i].source = sources[i].text;
+    }
 
+    runJobs(jobs, count, threadCount, backend);
 
+    int exitCode = 0;
+    for(int i = 0; i < count; i++) {
+        if(jobs[i].status == INTERPRET_OK) {
+            printValue(jobs[i].result);
+            printf("\n");
+        } else {
+            printf("%s: error\n", paths[i]);
+            if(jobs[i].status == INTERPREET_COMPILE_ERROR && exitCode == 0) exitCode = 65;
+            if(jobs[i].status == INTERPREET_RUNTIME_ERROR) exitCode = 70;
+        }
+        freeSource(&sources[i]);
+    }
+    free(sources);
+    free(jobs);
+    return exitCode;
+}
 
+/**
+ * Translates scripts into a C file of functions which an AOT library is built from, and builds the
+ * library with the system C compiler when asked to.
+ * @param paths the scripts
+ * @param count the number of scripts
+ * @param cPath the C file to write
+ * @param libraryPath the shared object to build, or NULL to only write the C file
+ * @return the exit code
+ */
+static int emitFiles(const char* paths[], int count, const char* cPath, const char* libraryPath) {
+    Source* sources = malloc(sizeof(Source) * count);
+    const char** texts = malloc(sizeof(const char*) * count);
+    for(int i = 0; i < count; i++) {
+        if(!loadSource(&sources[i], paths[i])) {
+            fprintf(stderr, "Could not read file \"%s\".\n", paths[i]);
+            exit(74);
+        }
+        texts[i] = sources[i].text;
+    }
 
+    int exitCode = 0;
+    FILE* file = fopen(cPath, "w");
+    if(file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", cPath);
+        exitCode = 74;
+    } else {
+        if(!emitLibrary(file, texts, count, NULL, 0)) exitCode = 65;
+        if(fclose(file) != 0 && exitCode == 0) exitCode = 74;
+    }
+    if(exitCode == 0 && libraryPath != NULL && !buildLibrary(cPath, libraryPath)) exitCode = 70;
 
+    for(int i = 0; i < count; i++) {
+        freeSource(&sources[i]);
+    }
+    free(texts);
+    free(sources);
+    return exitCode;
+}
 
+static void writeProfile(Profile* profile, bool text, const char* jsonPath) {
+    if(text) writeProfileText(profile, stderr);
+    if(jsonPath == NULL) return;
 
+    FILE* file = fopen(jsonPath, "w");
+    if(file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", jsonPath);
+        return;
+    }
+    writeProfileJson(profile, file);
+    fclose(file);
+}
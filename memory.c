@@ -1,7 +1,78 @@
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
+
 #include "memory.h"
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+#define ARENA_ALIGNMENT 16
+#define ALIGN_UP(size) (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t size;
+    size_t used;
+};
+
+#define BLOCK_HEADER ALIGN_UP(sizeof(ArenaBlock))
+
+typedef struct {
+    atomic_size_t liveBytes;
+    atomic_size_t peakBytes;
+    _Atomic uint64_t allocations;
+    _Atomic uint64_t resizes;
+    _Atomic uint64_t frees;
+} MemoryCounters;
+
+static const char* const categoryNames[] = {"bytecode", "lines", "constants", "vm", "total"};
+
+// Set once before any VM runs, so that allocations only pay for a branch when nobody asked.
+static bool statsEnabled = false;
+static MemoryCounters counters[MEMORY_TOTAL + 1];
+
+void enableMemoryStats(void) {
+    statsEnabled = true;
+}
+
+/**
+ * Adds one call to the counters of a category. Counters are updated atomically, so VMs on several
+ * threads can share them.
+ * @param counter the counters to update
+ * @param pointer the memory being resized, NULL for a new allocation
+ * @param newSize the size the memory has now, 0 if it was freed
+ */
+static void countCall(MemoryCounters* counter, void* pointer, size_t newSize) {
+    if(newSize == 0) {
+        atomic_fetch_add_explicit(&counter->frees, 1, memory_order_relaxed);
+    } else if(pointer == NULL) {
+        atomic_fetch_add_explicit(&counter->allocations, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&counter->resizes, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Changes the live bytes of a category and raises its peak if needed.
+ * @param counter the counters to update
+ * @param change the number of bytes to add. Unsigned arithmetic wraps, so a negated size subtracts it.
+ */
+static void countBytes(MemoryCounters* counter, size_t change) {
+    size_t live = atomic_fetch_add_explicit(&counter->liveBytes, change, memory_order_relaxed) + change;
+    size_t peak = atomic_load_explicit(&counter->peakBytes, memory_order_relaxed);
+    while(live > peak && !atomic_compare_exchange_weak_explicit(&counter->peakBytes, &peak, live,
+                                                                memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void* heapReallocate(Allocator* allocator, MemoryCategory category, void* pointer, size_t oldSize,
+                            size_t newSize) {
+    (void)allocator;
+    if(statsEnabled && (pointer != NULL || newSize != 0)) {
+        countCall(&counters[category], pointer, newSize);
+        countCall(&counters[MEMORY_TOTAL], pointer, newSize);
+        countBytes(&counters[category], newSize - oldSize);
+        countBytes(&counters[MEMORY_TOTAL], newSize - oldSize);
+    }
+
     if(newSize == 0) {
         free(pointer);
         return NULL;
@@ -10,4 +81,186 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     void* result = realloc(pointer, newSize);
     if(result == NULL) exit(1);
     return result;
-}
\ No newline at end of file
+}
+
+Allocator heapAllocator = {heapReallocate};
+
+/**
+ * Grows, shrinks, allocates or frees memory through the given allocator.
+ * @param allocator the allocator the memory belongs to
+ * @param category what the memory is used for
+ * @param pointer the memory to resize, NULL to allocate
+ * @param oldSize the size the memory was allocated with
+ * @param newSize the size wanted, 0 to free
+ * @return the resized memory, NULL when freed
+ */
+void* reallocate(Allocator* allocator, MemoryCategory category, void* pointer, size_t oldSize, size_t newSize) {
+    return allocator->reallocate(allocator, category, pointer, oldSize, newSize);
+}
+
+static uint8_t* blockData(ArenaBlock* block) {
+    return (uint8_t*)block + BLOCK_HEADER;
+}
+
+/**
+ * Bumps an allocation off the newest block, starting a new block when it does not fit. Requests
+ * larger than the block size get a block of their own.
+ * @param arena the arena to allocate from
+ * @param size the number of bytes wanted
+ * @return the new allocation
+ */
+static void* arenaAllocate(Arena* arena, size_t size) {
+    ArenaBlock* block = arena->blocks;
+    if(block == NULL || ALIGN_UP(block->used) + size > block->size) {
+        size_t blockSize = size > arena->blockSize ? ALIGN_UP(size) : arena->blockSize;
+        // Whatever is kept in the arena, the block is memory the VM holds on to.
+        block = reallocate(arena->parent, MEMORY_VM, NULL, 0, BLOCK_HEADER + blockSize);
+        block->next = arena->blocks;
+        block->size = blockSize;
+        block->used = 0;
+        arena->blocks = block;
+    }
+
+    void* result = blockData(block) + ALIGN_UP(block->used);
+    block->used = ALIGN_UP(block->used) + size;
+    arena->last = result;
+    return result;
+}
+
+/**
+ * Charges memory handed out by an arena to the category it is for. The blocks were charged to the
+ * VM when the arena took them from the heap, so the bytes are moved from the VM to the category,
+ * which leaves the total counting every block once.
+ * @param arena the arena the memory is in
+ * @param category what the memory is used for
+ * @param pointer the memory being resized, NULL for a new allocation
+ * @param oldSize the size the memory had
+ * @param newSize the size the memory has now, 0 if it was freed
+ */
+static void countArenaCall(Arena* arena, MemoryCategory category, void* pointer, size_t oldSize, size_t newSize) {
+    size_t change = newSize - oldSize;
+    countCall(&counters[category], pointer, newSize);
+    if(category == MEMORY_VM) return;
+    countBytes(&counters[category], change);
+    countBytes(&counters[MEMORY_VM], 0 - change);
+    arena->categoryBytes[category] += change;
+}
+
+static void* arenaResize(Arena* arena, void* pointer, size_t oldSize, size_t newSize) {
+    if(pointer != NULL && pointer == arena->last) {
+        ArenaBlock* block = arena->blocks;
+        size_t start = (size_t)((uint8_t*)pointer - blockData(block));
+        if(newSize == 0) {
+            block->used = start;
+            arena->last = NULL;
+            return NULL;
+        }
+        if(start + newSize <= block->size) {
+            block->used = start + newSize;
+            return pointer;
+        }
+    }
+    if(newSize == 0) return NULL;
+
+    void* result = arenaAllocate(arena, newSize);
+    if(pointer != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    return result;
+}
+
+static void* arenaReallocate(Allocator* allocator, MemoryCategory category, void* pointer, size_t oldSize,
+                             size_t newSize) {
+    Arena* arena = (Arena*)allocator;
+    void* result = arenaResize(arena, pointer, oldSize, newSize);
+    // Counted after any new block was charged, so the VM always has the bytes to give up.
+    if(statsEnabled && (pointer != NULL || newSize != 0)) {
+        countArenaCall(arena, category, pointer, oldSize, newSize);
+    }
+    return result;
+}
+
+/**
+ * Sets up an empty arena. Blocks are only taken from the parent once something is allocated.
+ * @param arena the arena to initialize
+ * @param parent the allocator the arena takes its blocks from
+ * @param blockSize the size of a block, allocations larger than this get a block of their own
+ */
+void initArena(Arena* arena, Allocator* parent, size_t blockSize) {
+    arena->allocator.reallocate = arenaReallocate;
+    arena->parent = parent;
+    arena->blocks = NULL;
+    arena->blockSize = blockSize;
+    arena->last = NULL;
+    memset(arena->categoryBytes, 0, sizeof(arena->categoryBytes));
+}
+
+/**
+ * Releases everything allocated from the arena at once. One block of the normal size is kept, so an
+ * arena which is reset after every small job stops calling its parent altogether.
+ * @param arena the arena to reset
+ */
+void resetArena(Arena* arena) {
+    // Whatever was still live in the arena goes back to being part of the VM's blocks.
+    for(int category = 0; category < MEMORY_TOTAL; category++) {
+        size_t bytes = arena->categoryBytes[category];
+        if(bytes == 0) continue;
+        countBytes(&counters[category], 0 - bytes);
+        countBytes(&counters[MEMORY_VM], bytes);
+        arena->categoryBytes[category] = 0;
+    }
+
+    ArenaBlock* kept = NULL;
+    ArenaBlock* block = arena->blocks;
+    while(block != NULL) {
+        ArenaBlock* next = block->next;
+        if(kept == NULL && block->size == arena->blockSize) {
+            kept = block;
+        } else {
+            reallocate(arena->parent, MEMORY_VM, block, BLOCK_HEADER + block->size, 0);
+        }
+        block = next;
+    }
+
+    if(kept != NULL) {
+        kept->next = NULL;
+        kept->used = 0;
+    }
+    arena->blocks = kept;
+    arena->last = NULL;
+}
+
+void freeArena(Arena* arena) {
+    resetArena(arena);
+    if(arena->blocks != NULL) {
+        reallocate(arena->parent, MEMORY_VM, arena->blocks, BLOCK_HEADER + arena->blocks->size, 0);
+    }
+    arena->blocks = NULL;
+}
+
+/**
+ * Reads the counters of a category. Memory kept in an arena is counted under what it holds, and
+ * only the unused rest of its blocks under the VM. The total counts calls to the heap alone, as
+ * arena calls never reach it.
+ * @param category the category to read, or MEMORY_TOTAL for all of them together
+ * @return the counters, all zero unless enableMemoryStats() was called
+ */
+MemoryStats getMemoryStats(MemoryCategory category) {
+    MemoryCounters* source = &counters[category];
+    MemoryStats stats;
+    stats.liveBytes = atomic_load_explicit(&source->liveBytes, memory_order_relaxed);
+    stats.peakBytes = atomic_load_explicit(&source->peakBytes, memory_order_relaxed);
+    stats.allocations = atomic_load_explicit(&source->allocations, memory_order_relaxed);
+    stats.resizes = atomic_load_explicit(&source->resizes, memory_order_relaxed);
+    stats.frees = atomic_load_explicit(&source->frees, memory_order_relaxed);
+    return stats;
+}
+
+void writeMemoryStats(FILE* out) {
+    fprintf(out, "%-10s %12s %12s %12s %12s %12s\n", "category", "live bytes", "peak bytes", "allocations",
+            "resizes", "frees");
+    for(int category = 0; category <= MEMORY_TOTAL; category++) {
+        MemoryStats stats = getMemoryStats((MemoryCategory)category);
+        fprintf(out, "%-10s %12zu %12zu %12llu %12llu %12llu\n", categoryNames[category], stats.liveBytes,
+                stats.peakBytes, (unsigned long long)stats.allocations, (unsigned long long)stats.resizes,
+                (unsigned long long)stats.frees);
+    }
+}
@@ -1,20 +1,81 @@
 #ifndef CLOX_MEMORY_H
 #define CLOX_MEMORY_H
 
+#include <stdio.h>
+
 #include "common.h"
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity * 2))
 
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(allocator, category, type, pointer, oldCount, newCount) \
+    (type*)reallocate(allocator, category, pointer, sizeof(type) * (oldCount), \
          sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(allocator, category, type, pointer, oldCount) \
+    reallocate(allocator, category, pointer, sizeof(type) * (oldCount), 0)
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+// What memory is used for, as reported by --mem-stats.
+typedef enum {
+    MEMORY_BYTECODE,
+    MEMORY_LINES,
+    MEMORY_CONSTANTS,
+    MEMORY_VM,
+    // Not a category of its own, queries the sum of all of them.
+    MEMORY_TOTAL
+} MemoryCategory;
 
-#endif //CLOX_MEMORY_H
+typedef struct {
+    size_t liveBytes;
+    size_t peakBytes;
+    uint64_t allocations;
+    uint64_t resizes;
+    uint64_t frees;
+} MemoryStats;
+
+typedef struct Allocator Allocator;
+
+/*
+ * An allocator is a single realloc-like function. Implementations embed this struct as their first
+ * member so the function can get back to the rest of their state.
+ */
+struct Allocator {
+    void* (*reallocate)(Allocator* allocator, MemoryCategory category, void* pointer, size_t oldSize,
+                        size_t newSize);
+};
+
+// Goes straight to realloc and free, and is where memory is accounted for. Used by everything that
+// is not given another allocator.
+extern Allocator heapAllocator;
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
 
+typedef struct ArenaBlock ArenaBlock;
+
+/*
+ * A bump allocator for memory that is released all at once. Frees are ignored except for the most
+ * recent allocation, which can also grow in place, so a single array growing through GROW_ARRAY
+ * does not leave a copy behind each time it doubles.
+ */
+typedef struct {
+    Allocator allocator;
+    Allocator* parent;
+    ArenaBlock* blocks;
+    size_t blockSize;
+    void* last;
+    // With memory stats on, the bytes handed out per category, given back to the blocks on reset.
+    size_t categoryBytes[MEMORY_TOTAL];
+} Arena;
+
+void* reallocate(Allocator* allocator, MemoryCategory category, void* pointer, size_t oldSize, size_t newSize);
+
+void initArena(Arena* arena, Allocator* parent, size_t blockSize);
+void resetArena(Arena* arena);
+void freeArena(Arena* arena);
+
+void enableMemoryStats(void);
+MemoryStats getMemoryStats(MemoryCategory category);
+void writeMemoryStats(FILE* out);
+
+#endif //CLOX_MEMORY_H
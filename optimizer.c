@@ -0,0 +1,310 @@
+#include <math.h>
+#include <string.h>
+
+#include "optimizer.h"
+
+/*
+ * A decoded instruction. Decoding undoes the fused forms, so the passes only ever see plain
+ * constant loads followed by plain operators, and the fused forms are chosen again on encoding.
+ */
+typedef struct {
+    uint8_t op;
+    // The constant index of an OP_CONSTANT, or the byte operand of an OP_GET_PARAM or OP_GET_LOCAL.
+    int operand;
+    int line;
+} Instruction;
+
+static const char* const passNames[] = {"redundant-negate", "constant-negate", "algebraic-identity",
+                                        "strength-reduction"};
+
+void initOptimizerStats(OptimizerStats* stats) {
+    memset(stats, 0, sizeof(OptimizerStats));
+}
+
+static bool isBinary(uint8_t op) {
+    return op == OP_ADD || op == OP_SUBTRACT || op == OP_MULTIPLY || op == OP_DIVIDE;
+}
+
+/**
+ * Maps a fused operator which takes a constant to the plain operator it stands for.
+ * @param op an opcode
+ * @return the plain binary operator, or op itself if it is not a fused operator
+ */
+static uint8_t unfusedOp(uint8_t op) {
+    switch(op) {
+        case OP_ADD_CONSTANT: return OP_ADD;
+        case OP_SUBTRACT_CONSTANT: return OP_SUBTRACT;
+        case OP_MULTIPLY_CONSTANT: return OP_MULTIPLY;
+        case OP_DIVIDE_CONSTANT: return OP_DIVIDE;
+        default: return op;
+    }
+}
+
+static uint8_t fusedOp(uint8_t op) {
+    switch(op) {
+        case OP_ADD: return OP_ADD_CONSTANT;
+        case OP_SUBTRACT: return OP_SUBTRACT_CONSTANT;
+        case OP_MULTIPLY: return OP_MULTIPLY_CONSTANT;
+        default: return OP_DIVIDE_CONSTANT;
+    }
+}
+
+/**
+ * Decodes a chunk into plain instructions, each with the line of the byte a runtime error in it
+ * would be reported at.
+ * @param chunk the chunk to decode
+ * @param code filled with the instructions, needs room for one per byte of the chunk
+ * @param dispatches set to the number of instructions the VM would dispatch for the chunk
+ * @return the number of decoded instructions
+ */
+static int decode(Chunk* chunk, Instruction* code, int* dispatches) {
+    int count = 0;
+    *dispatches = 0;
+    for(int offset = 0; offset < chunk->count; (*dispatches)++) {
+        uint8_t* bytes = chunk->code + offset;
+        int line = getLine(chunk, offset);
+        switch(bytes[0]) {
+            case OP_CONSTANT:
+            case OP_GET_PARAM:
+            case OP_GET_LOCAL:
+                code[count++] = (Instruction){bytes[0], bytes[1], line};
+                offset += 2;
+                break;
+            case OP_CONSTANT_LONG:
+                code[count++] = (Instruction){OP_CONSTANT, bytes[1] | (bytes[2] << 8) | (bytes[3] << 16), line};
+                offset += 4;
+                break;
+            case OP_CONSTANT_CONSTANT:
+                code[count++] = (Instruction){OP_CONSTANT, bytes[1], line};
+                code[count++] = (Instruction){OP_CONSTANT, bytes[2], getLine(chunk, offset + 2)};
+                offset += 3;
+                break;
+            case OP_ADD_CONSTANT:
+            case OP_SUBTRACT_CONSTANT:
+            case OP_MULTIPLY_CONSTANT:
+            case OP_DIVIDE_CONSTANT:
+                code[count++] = (Instruction){OP_CONSTANT, bytes[1], line};
+                code[count++] = (Instruction){unfusedOp(bytes[0]), 0, getLine(chunk, offset + 1)};
+                offset += 2;
+                break;
+            default:
+                code[count++] = (Instruction){bytes[0], 0, line};
+                offset += 1;
+                break;
+        }
+    }
+    return count;
+}
+
+/**
+ * Writes instructions back over the chunk, fusing a constant load with the operator or the load
+ * after it the same way the compiler does. The line table is rebuilt from the lines of the
+ * instructions.
+ * @param chunk the chunk to overwrite
+ * @param code the instructions
+ * @param count the number of instructions
+ * @return the number of instructions the VM will dispatch
+ */
+static int encode(Chunk* chunk, Instruction* code, int count) {
+    int dispatches = 0;
+    truncateChunk(chunk, 0);
+    for(int i = 0; i < count; i++, dispatches++) {
+        Instruction* instruction = &code[i];
+        Instruction* next = i + 1 < count ? &code[i + 1] : NULL;
+        if(instruction->op != OP_CONSTANT) {
+            writeChunk(chunk, instruction->op, instruction->line);
+            if(instruction->op == OP_GET_PARAM || instruction->op == OP_GET_LOCAL) {
+                writeChunk(chunk, (uint8_t)instruction->operand, instruction->line);
+            }
+            continue;
+        }
+
+        int constant = instruction->operand;
+        if(constant > UINT8_MAX) {
+            writeChunk(chunk, OP_CONSTANT_LONG, instruction->line);
+            writeChunk(chunk, (uint8_t)(constant & 0xff), instruction->line);
+            writeChunk(chunk, (uint8_t)((constant >> 8) & 0xff), instruction->line);
+            writeChunk(chunk, (uint8_t)((constant >> 16) & 0xff), instruction->line);
+        } else if(next != NULL && isBinary(next->op)) {
+            writeChunk(chunk, fusedOp(next->op), instruction->line);
+            writeChunk(chunk, (uint8_t)constant, next->line);
+            i++;
+        } else if(next != NULL && next->op == OP_CONSTANT && next->operand <= UINT8_MAX &&
+                  !(i + 2 < count && isBinary(code[i + 2].op))) {
+            // A load followed by an operator is left for that operator to fuse with instead.
+            writeChunk(chunk, OP_CONSTANT_CONSTANT, instruction->line);
+            writeChunk(chunk, (uint8_t)constant, instruction->line);
+            writeChunk(chunk, (uint8_t)next->operand, next->line);
+            i++;
+        } else {
+            writeChunk(chunk, OP_CONSTANT, instruction->line);
+            writeChunk(chunk, (uint8_t)constant, instruction->line);
+        }
+    }
+    return dispatches;
+}
+
+/**
+ * Looks up the number an instruction loads.
+ * @param chunk the chunk the instruction belongs to
+ * @param instruction the instruction
+ * @param value set to the number if the instruction loads one
+ * @return true if the instruction is a constant load of a number
+ */
+static bool loadsNumber(Chunk* chunk, Instruction* instruction, double* value) {
+    if(instruction->op != OP_CONSTANT) return false;
+    Value constant = chunk->constants.values[instruction->operand];
+    if(!IS_NUMBER(constant)) return false;
+    *value = AS_NUMBER(constant);
+    return true;
+}
+
+/**
+ * Whether x op c is x for every x. Only identities which hold bit for bit are used: x + 0 is not
+ * one of them, as -0 + 0 is +0, but x + -0 is. The one value they do not hold for is a signalling
+ * NaN, which the operation would have quieted.
+ * @param op a binary operator
+ * @param c the constant right operand
+ * @return true if the operation can be left out
+ */
+static bool isRightIdentity(uint8_t op, double c) {
+    switch(op) {
+        case OP_ADD: return c == 0.0 && signbit(c);
+        case OP_SUBTRACT: return c == 0.0 && !signbit(c);
+        case OP_MULTIPLY:
+        case OP_DIVIDE: return c == 1.0;
+        default: return false;
+    }
+}
+
+/**
+ * Whether dividing by a number can be replaced by multiplying with its reciprocal. That holds for
+ * every dividend when the reciprocal is exact, since both then round the same real number, which
+ * is the case for normal powers of two.
+ * @param divisor the constant divisor
+ * @param reciprocal set to the exact reciprocal
+ * @return true if the division can become a multiplication
+ */
+static bool exactReciprocal(double divisor, double* reciprocal) {
+    uint64_t bits;
+    memcpy(&bits, &divisor, sizeof(double));
+    int exponent = (int)((bits >> 52) & 0x7ff);
+    if((bits & 0xfffffffffffffULL) != 0 || exponent == 0 || exponent == 0x7ff) return false;
+    *reciprocal = 1.0 / divisor;
+    return true;
+}
+
+/**
+ * Runs one pass over the instructions. Every pass reads the instructions in order and compares each
+ * one with the last instruction it kept, so a rewrite can enable another one right after it.
+ * @param chunk the chunk the instructions belong to, which new constants are added to
+ * @param pass the pass to run
+ * @param code the instructions, rewritten in place
+ * @param count the number of instructions, updated when instructions are removed
+ * @return the number of rewrites made
+ */
+static int runPass(Chunk* chunk, OptimizerPass pass, Instruction* code, int* count) {
+    int rewrites = 0;
+    int kept = 0;
+    for(int i = 0; i < *count; i++) {
+        Instruction instruction = code[i];
+        Instruction* last = kept > 0 ? &code[kept - 1] : NULL;
+        double c;
+
+        switch(pass) {
+            case PASS_REDUNDANT_NEGATE:
+                // Negating flips the sign bit, so two of them cancel out even for NaN.
+                if(instruction.op == OP_NEGATE && last != NULL && last->op == OP_NEGATE) {
+                    kept--;
+                    rewrites++;
+                    continue;
+                }
+                break;
+            case PASS_CONSTANT_NEGATE:
+                if(instruction.op == OP_NEGATE && last != NULL && loadsNumber(chunk, last, &c) &&
+                   chunk->constants.count <= CONSTANT_LONG_MAX) {
+                    last->operand = addConstant(chunk, NUMBER_VAL(-c));
+                    last->line = instruction.line;
+                    rewrites++;
+                    continue;
+                }
+                break;
+            case PASS_ALGEBRAIC_IDENTITY:
+                if(isBinary(instruction.op) && last != NULL && loadsNumber(chunk, last, &c) &&
+                   isRightIdentity(instruction.op, c)) {
+                    kept--;
+                    rewrites++;
+                    continue;
+                }
+                break;
+            case PASS_STRENGTH_REDUCTION: {
+                double reciprocal;
+                if(instruction.op == OP_DIVIDE && last != NULL && loadsNumber(chunk, last, &c) &&
+                   exactReciprocal(c, &reciprocal) && chunk->constants.count <= CONSTANT_LONG_MAX) {
+                    last->operand = addConstant(chunk, NUMBER_VAL(reciprocal));
+                    instruction.op = OP_MULTIPLY;
+                    rewrites++;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        code[kept++] = instruction;
+    }
+    *count = kept;
+    return rewrites;
+}
+
+/**
+ * Rewrites a compiled chunk in place with peephole passes that leave every result bit for bit the
+ * same. The passes are repeated until none of them finds anything, as removing one instruction can
+ * bring two others together. Constants which are no longer loaded stay in the chunk's value array.
+ * @param chunk the compiled chunk, which must not be a read-only one from the bytecode cache
+ * @param stats the statistics to add to, or NULL
+ */
+void optimizeChunk(Chunk* chunk, OptimizerStats* stats) {
+    int capacity = chunk->count;
+    Instruction* code = GROW_ARRAY(chunk->allocator, MEMORY_BYTECODE, Instruction, NULL, 0, capacity);
+    int bytesBefore = chunk->count;
+    int dispatchesBefore;
+    int count = decode(chunk, code, &dispatchesBefore);
+
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(int pass = 0; pass < PASS_COUNT; pass++) {
+            int before = count;
+            int rewrites = runPass(chunk, (OptimizerPass)pass, code, &count);
+            if(rewrites == 0) continue;
+            changed = true;
+            if(stats != NULL) {
+                stats->rewrites[pass] += (uint64_t)rewrites;
+                stats->instructionsRemoved[pass] += (uint64_t)(before - count);
+            }
+        }
+    }
+
+    int dispatchesAfter = encode(chunk, code, count);
+    chunk->maxStack = maxStackDepth(chunk);
+    FREE_ARRAY(chunk->allocator, MEMORY_BYTECODE, Instruction, code, capacity);
+
+    if(stats == NULL) return;
+    stats->chunks++;
+    stats->instructionsBefore += (uint64_t)dispatchesBefore;
+    stats->instructionsAfter += (uint64_t)dispatchesAfter;
+    stats->bytesBefore += (uint64_t)bytesBefore;
+    stats->bytesAfter += (uint64_t)chunk->count;
+}
+
+void writeOptimizerStats(OptimizerStats* stats, FILE* out) {
+    fprintf(out, "%-20s %12s %12s\n", "pass", "rewrites", "removed");
+    for(int pass = 0; pass < PASS_COUNT; pass++) {
+        fprintf(out, "%-20s %12llu %12llu\n", passNames[pass], (unsigned long long)stats->rewrites[pass],
+                (unsigned long long)stats->instructionsRemoved[pass]);
+    }
+    fprintf(out, "%llu chunks, %llu -> %llu instructions, %llu -> %llu bytes\n",
+            (unsigned long long)stats->chunks, (unsigned long long)stats->instructionsBefore,
+            (unsigned long long)stats->instructionsAfter, (unsigned long long)stats->bytesBefore,
+            (unsigned long long)stats->bytesAfter);
+}
@@ -0,0 +1,35 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+typedef enum {
+    PASS_REDUNDANT_NEGATE,
+    PASS_CONSTANT_NEGATE,
+    PASS_ALGEBRAIC_IDENTITY,
+    PASS_STRENGTH_REDUCTION,
+    PASS_COUNT
+} OptimizerPass;
+
+/*
+ * What the peephole passes did, added up over every chunk they ran on. The totals count
+ * instructions as the VM dispatches them, so a fused instruction counts once. What a pass removed
+ * is counted before fusion, where a fused instruction is its constant load and its operator.
+ */
+typedef struct {
+    uint64_t rewrites[PASS_COUNT];
+    uint64_t instructionsRemoved[PASS_COUNT];
+    uint64_t chunks;
+    uint64_t instructionsBefore;
+    uint64_t instructionsAfter;
+    uint64_t bytesBefore;
+    uint64_t bytesAfter;
+} OptimizerStats;
+
+void initOptimizerStats(OptimizerStats* stats);
+void optimizeChunk(Chunk* chunk, OptimizerStats* stats);
+void writeOptimizerStats(OptimizerStats* stats, FILE* out);
+
+#endif //CLOX_OPTIMIZER_H
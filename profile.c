@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "profile.h"
+
+// Only the hottest offsets are listed in the text report. The JSON report has all of them.
+#define PROFILE_TEXT_OFFSETS 20
+
+typedef struct {
+    int index;
+    ProfileCounter counter;
+} ProfileEntry;
+
+void initProfile(Profile* profile) {
+    memset(profile->opcodes, 0, sizeof(profile->opcodes));
+    profile->offsetCapacity = 0;
+    profile->offsets = NULL;
+    profile->offsetOpcodes = NULL;
+    profile->offsetLines = NULL;
+    profile->runningOffset = -1;
+    profile->runningOpcode = 0;
+    profile->runningSince = 0;
+}
+
+void freeProfile(Profile* profile) {
+    FREE_ARRAY(&heapAllocator, MEMORY_VM, ProfileCounter, profile->offsets, profile->offsetCapacity);
+    FREE_ARRAY(&heapAllocator, MEMORY_VM, uint8_t, profile->offsetOpcodes, profile->offsetCapacity);
+    FREE_ARRAY(&heapAllocator, MEMORY_VM, int, profile->offsetLines, profile->offsetCapacity);
+    initProfile(profile);
+}
+
+/**
+ * Makes room for a counter at every offset of the chunk about to run and records the opcode and
+ * line found at each offset for the report.
+ * @param profile the profile to record into
+ * @param chunk the chunk which is about to run
+ */
+void beginProfileRun(Profile* profile, Chunk* chunk) {
+    if(chunk->count > profile->offsetCapacity) {
+        int oldCapacity = profile->offsetCapacity;
+        profile->offsetCapacity = chunk->count;
+        profile->offsets = GROW_ARRAY(&heapAllocator, MEMORY_VM, ProfileCounter, profile->offsets,
+                                      oldCapacity, profile->offsetCapacity);
+        profile->offsetOpcodes = GROW_ARRAY(&heapAllocator, MEMORY_VM, uint8_t, profile->offsetOpcodes,
+                                            oldCapacity, profile->offsetCapacity);
+        profile->offsetLines = GROW_ARRAY(&heapAllocator, MEMORY_VM, int, profile->offsetLines,
+                                          oldCapacity, profile->offsetCapacity);
+        memset(profile->offsets + oldCapacity, 0,
+               sizeof(ProfileCounter) * (profile->offsetCapacity - oldCapacity));
+    }
+
+    for(int offset = 0; offset < chunk->count; offset++) {
+        profile->offsetOpcodes[offset] = chunk->code[offset];
+        profile->offsetLines[offset] = getLine(chunk, offset);
+    }
+    profile->runningOffset = -1;
+}
+
+/**
+ * Charges the time since the last dispatch to the instruction which ended the run. OP_RETURN calls
+ * this before printing its result, after which calling it again does nothing.
+ * @param profile the profile being recorded into
+ */
+void endProfileRun(Profile* profile) {
+    if(profile->runningOffset < 0) return;
+
+    uint64_t elapsed = profileClock() - profile->runningSince;
+    profile->opcodes[profile->runningOpcode].cycles += elapsed;
+    profile->offsets[profile->runningOffset].cycles += elapsed;
+    profile->runningOffset = -1;
+}
+
+static int compareEntries(const void* a, const void* b) {
+    const ProfileCounter* counterA = &((const ProfileEntry*)a)->counter;
+    const ProfileCounter* counterB = &((const ProfileEntry*)b)->counter;
+    if(counterA->cycles != counterB->cycles) return counterA->cycles < counterB->cycles ? 1 : -1;
+    if(counterA->count != counterB->count) return counterA->count < counterB->count ? 1 : -1;
+    return ((const ProfileEntry*)a)->index - ((const ProfileEntry*)b)->index;
+}
+
+/**
+ * Collects the counters which were hit, hottest first. When only a few are wanted they are kept
+ * in a short sorted list instead of sorting every offset of a large chunk.
+ * @param counters the counters to sort
+ * @param count the number of counters
+ * @param limit the most entries to return
+ * @param total set to the sum of all the counters
+ * @param entryCount set to the number of entries returned
+ * @return a malloc'd array of the entries, which the caller frees
+ */
+static ProfileEntry* sortCounters(ProfileCounter* counters, int count, int limit,
+                                  ProfileCounter* total, int* entryCount) {
+    if(limit > count) limit = count;
+    ProfileEntry* entries = malloc(sizeof(ProfileEntry) * (limit > 0 ? limit : 1));
+    *total = (ProfileCounter){0, 0};
+    *entryCount = 0;
+
+    for(int i = 0; i < count; i++) {
+        if(counters[i].count == 0) continue;
+        total->count += counters[i].count;
+        total->cycles += counters[i].cycles;
+
+        ProfileEntry entry = {i, counters[i]};
+        if(limit == count) {
+            entries[(*entryCount)++] = entry;
+            continue;
+        }
+        if(*entryCount == limit && compareEntries(&entry, &entries[limit - 1]) >= 0) continue;
+
+        int slot = *entryCount < limit ? (*entryCount)++ : limit - 1;
+        while(slot > 0 && compareEntries(&entry, &entries[slot - 1]) < 0) {
+            entries[slot] = entries[slot - 1];
+            slot--;
+        }
+        entries[slot] = entry;
+    }
+
+    if(limit == count) qsort(entries, *entryCount, sizeof(ProfileEntry), compareEntries);
+    return entries;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole == 0 ? 0.0 : 100.0 * (double)part / (double)whole;
+}
+
+static double perInstruction(ProfileCounter counter) {
+    return counter.count == 0 ? 0.0 : (double)counter.cycles / (double)counter.count;
+}
+
+void writeProfileText(Profile* profile, FILE* file) {
+    ProfileCounter total;
+    int count;
+    ProfileEntry* entries = sortCounters(profile->opcodes, UINT8_MAX + 1, UINT8_MAX + 1, &total, &count);
+
+    fprintf(file, "== profile ==\n");
+    fprintf(file, "%llu instructions, %llu %s\n\n", (unsigned long long)total.count,
+            (unsigned long long)total.cycles, PROFILE_CLOCK_UNIT);
+    fprintf(file, "%-22s %14s %16s %10s %7s\n", "opcode", "count", PROFILE_CLOCK_UNIT, "per op", "time");
+    for(int i = 0; i < count; i++) {
+        ProfileCounter counter = entries[i].counter;
+        fprintf(file, "%-22s %14llu %16llu %10.2f %6.2f%%\n", opcodeName((uint8_t)entries[i].index),
+                (unsigned long long)counter.count, (unsigned long long)counter.cycles,
+                perInstruction(counter), percent(counter.cycles, total.cycles));
+    }
+    free(entries);
+
+    entries = sortCounters(profile->offsets, profile->offsetCapacity, PROFILE_TEXT_OFFSETS, &total, &count);
+    fprintf(file, "\n%-6s %5s %-22s %14s %16s %10s %7s\n", "offset", "line", "opcode", "count",
+            PROFILE_CLOCK_UNIT, "per op", "time");
+    for(int i = 0; i < count; i++) {
+        int offset = entries[i].index;
+        ProfileCounter counter = entries[i].counter;
+        fprintf(file, "%6d %5d %-22s %14llu %16llu %10.2f %6.2f%%\n", offset, profile->offsetLines[offset],
+                opcodeName(profile->offsetOpcodes[offset]), (unsigned long long)counter.count,
+                (unsigned long long)counter.cycles, perInstruction(counter),
+                percent(counter.cycles, total.cycles));
+    }
+    free(entries);
+}
+
+void writeProfileJson(Profile* profile, FILE* file) {
+    ProfileCounter total;
+    int count;
+    ProfileEntry* entries = sortCounters(profile->opcodes, UINT8_MAX + 1, UINT8_MAX + 1, &total, &count);
+
+    fprintf(file, "{\n  \"unit\": \"%s\",\n  \"instructions\": %llu,\n  \"time\": %llu,\n  \"opcodes\": [",
+            PROFILE_CLOCK_UNIT, (unsigned long long)total.count, (unsigned long long)total.cycles);
+    for(int i = 0; i < count; i++) {
+        fprintf(file, "%s\n    {\"opcode\": \"%s\", \"count\": %llu, \"time\": %llu}", i == 0 ? "" : ",",
+                opcodeName((uint8_t)entries[i].index), (unsigned long long)entries[i].counter.count,
+                (unsigned long long)entries[i].counter.cycles);
+    }
+    free(entries);
+
+    entries = sortCounters(profile->offsets, profile->offsetCapacity, profile->offsetCapacity, &total, &count);
+    fprintf(file, "\n  ],\n  \"offsets\": [");
+    for(int i = 0; i < count; i++) {
+        int offset = entries[i].index;
+        fprintf(file, "%s\n    {\"offset\": %d, \"line\": %d, \"opcode\": \"%s\", \"count\": %llu, \"time\": %llu}",
+                i == 0 ? "" : ",", offset, profile->offsetLines[offset],
+                opcodeName(profile->offsetOpcodes[offset]), (unsigned long long)entries[i].counter.count,
+                (unsigned long long)entries[i].counter.cycles);
+    }
+    free(entries);
+    fprintf(file, "\n  ]\n}\n");
+}
@@ -0,0 +1,82 @@
+#ifndef CLOX_PROFILE_H
+#define CLOX_PROFILE_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+// The time stamp counter is far cheaper to read than clock_gettime, so use it where there is one.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define PROFILE_RDTSC
+#define PROFILE_CLOCK_UNIT "cycles"
+#else
+#include <time.h>
+#define PROFILE_CLOCK_UNIT "ns"
+#endif
+
+typedef struct {
+    uint64_t count;
+    uint64_t cycles;
+} ProfileCounter;
+
+/*
+ * Execution counts and time per opcode and per bytecode offset. Time is measured between two
+ * consecutive dispatches, so an instruction is charged everything up to the next one starting.
+ * Offsets from every chunk the VM runs are added together, which is exact for a single script.
+ */
+typedef struct {
+    ProfileCounter opcodes[UINT8_MAX + 1];
+    int offsetCapacity;
+    ProfileCounter* offsets;
+    uint8_t* offsetOpcodes;
+    int* offsetLines;
+    int runningOffset;
+    uint8_t runningOpcode;
+    uint64_t runningSince;
+} Profile;
+
+void initProfile(Profile* profile);
+void freeProfile(Profile* profile);
+void beginProfileRun(Profile* profile, Chunk* chunk);
+void endProfileRun(Profile* profile);
+void writeProfileText(Profile* profile, FILE* file);
+void writeProfileJson(Profile* profile, FILE* file);
+
+/**
+ * @return a timestamp in PROFILE_CLOCK_UNIT
+ */
+static inline uint64_t profileClock(void) {
+#ifdef PROFILE_RDTSC
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * Charges the time since the last dispatch to the instruction which was running, then starts
+ * timing the instruction at offset. Called by the profiled loop before every dispatch.
+ * @param profile the profile to record into
+ * @param chunk the chunk being run
+ * @param offset the offset of the instruction about to run
+ */
+static inline void profileInstruction(Profile* profile, Chunk* chunk, int offset) {
+    uint64_t now = profileClock();
+    if(profile->runningOffset >= 0) {
+        uint64_t elapsed = now - profile->runningSince;
+        profile->opcodes[profile->runningOpcode].cycles += elapsed;
+        profile->offsets[profile->runningOffset].cycles += elapsed;
+    }
+
+    uint8_t opcode = chunk->code[offset];
+    profile->opcodes[opcode].count++;
+    profile->offsets[offset].count++;
+    profile->runningOffset = offset;
+    profile->runningOpcode = opcode;
+    profile->runningSince = now;
+}
+
+#endif //CLOX_PROFILE_H
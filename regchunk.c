@@ -0,0 +1,45 @@
+#include "regchunk.h"
+
+/**
+ * Initializes an empty register chunk which shares the constant pool of the stack chunk it is
+ * compiled from, and keeps its instructions in the same allocator as that pool.
+ * @param chunk the register chunk to initialize
+ * @param constants the value array holding the constants that K operands refer to
+ */
+void initRegChunk(RegChunk* chunk, ValueArray* constants) {
+    chunk->count = 0;
+    chunk->capacity = 0;
+    chunk->code = NULL;
+    chunk->lines = NULL;
+    chunk->registerCount = 0;
+    chunk->constants = constants;
+    chunk->allocator = constants->allocator;
+}
+
+/**
+ * Adds an instruction to the end of a given register chunk.
+ * @param chunk pointer to the register chunk to append the instruction to
+ * @param instruction the encoded three-address instruction
+ * @param line the line of code that the instruction corresponds to
+ */
+void writeRegChunk(RegChunk* chunk, uint32_t instruction, int line) {
+    if(chunk->capacity < chunk->count + 1) {
+        int oldCapacity = chunk->capacity;
+        chunk->capacity = GROW_CAPACITY(oldCapacity);
+        chunk->code = GROW_ARRAY(chunk->allocator, MEMORY_BYTECODE, uint32_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(chunk->allocator, MEMORY_LINES, int, chunk->lines, oldCapacity, chunk->capacity);
+    }
+    chunk->code[chunk->count] = instruction;
+    chunk->lines[chunk->count] = line;
+    chunk->count++;
+}
+
+/**
+ * Frees the instructions held by the register chunk. The shared constant pool is left alone.
+ * @param chunk the register chunk who's memory is to be freed
+ */
+void freeRegChunk(RegChunk* chunk) {
+    FREE_ARRAY(chunk->allocator, MEMORY_BYTECODE, uint32_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(chunk->allocator, MEMORY_LINES, int, chunk->lines, chunk->capacity);
+    initRegChunk(chunk, chunk->constants);
+}
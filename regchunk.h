@@ -0,0 +1,61 @@
+#ifndef CLOX_REGCHUNK_H
+#define CLOX_REGCHUNK_H
+
+#include "common.h"
+#include "memory.h"
+#include "value.h"
+
+/*
+ * Three-address instructions for the register backend. Each instruction is one 32-bit word:
+ * the opcode in the low byte followed by the operands A, B and C, one byte each. Operands are
+ * register numbers (R) or indexes into the constant pool (K). LOADK takes a 16-bit constant
+ * index Bx in place of B and C, larger indexes use LOADKX followed by a whole word holding the index.
+ */
+typedef enum {
+    ROP_LOADK,       // R[A] = K[Bx]
+    ROP_LOADKX,      // R[A] = K[next word]
+    ROP_NEGATE,      // R[A] = -R[B]
+    ROP_ADD_RR,      // R[A] = R[B] + R[C]
+    ROP_ADD_RK,      // R[A] = R[B] + K[C]
+    ROP_ADD_KR,      // R[A] = K[B] + R[C]
+    ROP_SUBTRACT_RR,
+    ROP_SUBTRACT_RK,
+    ROP_SUBTRACT_KR,
+    ROP_MULTIPLY_RR,
+    ROP_MULTIPLY_RK,
+    ROP_MULTIPLY_KR,
+    ROP_DIVIDE_RR,
+    ROP_DIVIDE_RK,
+    ROP_DIVIDE_KR,
+    ROP_RETURN,      // return R[A]
+    ROP_LOADPARAM,   // R[A] = params[B]
+} RegOpCode;
+
+#define REG_OP(instruction) ((RegOpCode)((instruction) & 0xff))
+#define REG_A(instruction)  (((instruction) >> 8) & 0xff)
+#define REG_B(instruction)  (((instruction) >> 16) & 0xff)
+#define REG_C(instruction)  ((instruction) >> 24)
+#define REG_BX(instruction) ((instruction) >> 16)
+
+#define REG_ABC(op, a, b, c) \
+    ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 24))
+#define REG_ABX(op, a, bx) \
+    ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(bx) << 16))
+
+#define REGISTER_MAX (UINT8_MAX + 1)
+
+typedef struct {
+    int count;
+    int capacity;
+    uint32_t* code;
+    int* lines;
+    int registerCount;
+    ValueArray* constants;
+    Allocator* allocator;
+} RegChunk;
+
+void initRegChunk(RegChunk* chunk, ValueArray* constants);
+void writeRegChunk(RegChunk* chunk, uint32_t instruction, int line);
+void freeRegChunk(RegChunk* chunk);
+
+#endif //CLOX_REGCHUNK_H
@@ -0,0 +1,191 @@
+/*
+ * The stack VM's interpreter loop. This is not a normal header: vm.c includes it once for every
+ * variant of the loop it needs, defining beforehand
+ *
+ *   RUN_FUNCTION           the name of the function to define
+ *   TRACE_INSTRUCTION()    a hook which may print the instruction about to be dispatched
+ *   PROFILE_INSTRUCTION()  a hook run before each instruction is dispatched
+ *   PROFILE_RETURN()       a hook run by OP_RETURN before the result is printed
+ *
+ * so that instrumentation costs nothing in the loop which runs without it. The hooks must read the
+ * locals ip and stackTop rather than the VM, whose copies are only brought up to date on exit.
+ */
+
+/**
+ * Executes a chunk on the stack VM. The instruction pointer and the stack top live in locals, so the
+ * compiler can keep them in registers instead of going through the VM for every byte and value.
+ * They are only written back to the VM when the loop exits, by a runtime error or by returning, as
+ * runtimeError() and the caller read them there.
+ */
+static InterpretResult RUN_FUNCTION(VM* vm) {
+    uint8_t* ip = vm->ip;
+    Value* stack = vm->stack;
+    Value* stackTop = vm->stackTop;
+    Value* constants = vm->chunk->constants.values;
+    const double* params = vm->params;
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() \
+    (ip += 3, constants[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)])
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define SAVE_STATE() (vm->ip = ip, vm->stackTop = stackTop)
+#define BINARY_OP(valueType, op) \
+    do { \
+      if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        SAVE_STATE(); \
+        runtimeError(vm, "Operands must be numbers."); \
+        return INTERPREET_RUNTIME_ERROR; \
+      } \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(PEEK(0)); \
+      PEEK(0) = valueType(a op b); \
+    } while (false)
+#define BINARY_CONSTANT_OP(valueType, op) \
+    do { \
+      Value constant = READ_CONSTANT(); \
+      if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(constant)) { \
+        SAVE_STATE(); \
+        runtimeError(vm, "Operands must be numbers."); \
+        return INTERPREET_RUNTIME_ERROR; \
+      } \
+      PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op AS_NUMBER(constant)); \
+    } while (false)
+
+#ifdef PROFILE_OPCODE_PAIRS
+#define PROFILE_PAIR() \
+    do { \
+        if(vm->previousOpcode >= 0) vm->opcodePairs[vm->previousOpcode][*ip]++; \
+        vm->previousOpcode = *ip; \
+    } while (false)
+    vm->previousOpcode = -1;
+#else
+#define PROFILE_PAIR() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+            [OP_CONSTANT] = &&op_OP_CONSTANT,
+            [OP_RETURN]   = &&op_OP_RETURN,
+            [OP_NEGATE]   = &&op_OP_NEGATE,
+            [OP_ADD]      = &&op_OP_ADD,
+            [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+            [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+            [OP_DIVIDE]   = &&op_OP_DIVIDE,
+            [OP_ADD_CONSTANT]      = &&op_OP_ADD_CONSTANT,
+            [OP_SUBTRACT_CONSTANT] = &&op_OP_SUBTRACT_CONSTANT,
+            [OP_MULTIPLY_CONSTANT] = &&op_OP_MULTIPLY_CONSTANT,
+            [OP_DIVIDE_CONSTANT]   = &&op_OP_DIVIDE_CONSTANT,
+            [OP_CONSTANT_CONSTANT] = &&op_OP_CONSTANT_CONSTANT,
+            [OP_CONSTANT_LONG]     = &&op_OP_CONSTANT_LONG,
+            [OP_GET_PARAM]         = &&op_OP_GET_PARAM,
+            [OP_GET_LOCAL]         = &&op_OP_GET_LOCAL,
+    };
+#define CASE(opcode) op_##opcode:
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        PROFILE_PAIR(); \
+        PROFILE_INSTRUCTION(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+
+    DISPATCH();
+#else
+#define CASE(opcode) case opcode:
+#define DISPATCH() continue
+
+    for(;;) {
+        TRACE_INSTRUCTION();
+        PROFILE_PAIR();
+        PROFILE_INSTRUCTION();
+        switch (READ_BYTE()) {
+#endif
+            CASE(OP_CONSTANT) {
+                Value constant = READ_CONSTANT();
+                PUSH(constant);
+                DISPATCH();
+            }
+            CASE(OP_NEGATE) {
+                if(!IS_NUMBER(PEEK(0))) {
+                    SAVE_STATE();
+                    runtimeError(vm, "Operand must be a number.");
+                    return INTERPREET_RUNTIME_ERROR;
+                }
+                PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+                DISPATCH();
+            }
+            CASE(OP_RETURN) {
+                vm->result = POP();
+                SAVE_STATE();
+                PROFILE_RETURN();
+                if(vm->printResult) {
+                    printValue(vm->result);
+                    printf("\n");
+                }
+                return INTERPRET_OK;
+            }
+            CASE(OP_ADD)
+                BINARY_OP(NUMBER_VAL, +); DISPATCH();
+            CASE(OP_SUBTRACT)
+                BINARY_OP(NUMBER_VAL, -); DISPATCH();
+            CASE(OP_MULTIPLY)
+                BINARY_OP(NUMBER_VAL, *); DISPATCH();
+            CASE(OP_DIVIDE)
+                BINARY_OP(NUMBER_VAL, /); DISPATCH();
+            CASE(OP_ADD_CONSTANT)
+                BINARY_CONSTANT_OP(NUMBER_VAL, +); DISPATCH();
+            CASE(OP_SUBTRACT_CONSTANT)
+                BINARY_CONSTANT_OP(NUMBER_VAL, -); DISPATCH();
+            CASE(OP_MULTIPLY_CONSTANT)
+                BINARY_CONSTANT_OP(NUMBER_VAL, *); DISPATCH();
+            CASE(OP_DIVIDE_CONSTANT)
+                BINARY_CONSTANT_OP(NUMBER_VAL, /); DISPATCH();
+            CASE(OP_CONSTANT_CONSTANT) {
+                PUSH(READ_CONSTANT());
+                PUSH(READ_CONSTANT());
+                DISPATCH();
+            }
+            CASE(OP_CONSTANT_LONG) {
+                Value constant = READ_CONSTANT_LONG();
+                PUSH(constant);
+                DISPATCH();
+            }
+            CASE(OP_GET_PARAM) {
+                uint8_t param = READ_BYTE();
+                if(params == NULL) {
+                    SAVE_STATE();
+                    runtimeError(vm, "No value given for parameter %d.", param);
+                    return INTERPREET_RUNTIME_ERROR;
+                }
+                PUSH(NUMBER_VAL(params[param]));
+                DISPATCH();
+            }
+            CASE(OP_GET_LOCAL) {
+                PUSH(stack[READ_BYTE()]);
+                DISPATCH();
+            }
+#ifndef COMPUTED_GOTO
+        }
+    }
+#endif
+#undef READ_BYTE
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef SAVE_STATE
+#undef BINARY_OP
+#undef BINARY_CONSTANT_OP
+#undef PROFILE_PAIR
+#undef CASE
+#undef DISPATCH
+}
+
+#undef RUN_FUNCTION
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef PROFILE_RETURN
@@ -0,0 +1,71 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "runner.h"
+
+typedef struct {
+    Job* jobs;
+    int count;
+    Backend backend;
+    atomic_int next;
+} JobQueue;
+
+/**
+ * Body of every thread in the pool. Each thread owns a VM and keeps taking the next job off the
+ * queue until none are left, so uneven sources still spread over all threads.
+ * @param argument the shared JobQueue
+ * @return NULL
+ */
+static void* worker(void* argument) {
+    JobQueue* queue = (JobQueue*)argument;
+    VM vm;
+    initVM(&vm);
+    vm.printResult = false;
+
+    for(;;) {
+        int index = atomic_fetch_add(&queue->next, 1);
+        if(index >= queue->count) break;
+
+        Job* job = &queue->jobs[index];
+        job->status = interpret(&vm, job->source, queue->backend);
+        job->result = vm.result;
+    }
+
+    freeVM(&vm);
+    return NULL;
+}
+
+/**
+ * Interprets many independent sources in parallel. The calling thread works alongside
+ * threadCount - 1 new threads and returns once every job has its status and result filled in.
+ * @param jobs the sources to run
+ * @param count the number of jobs
+ * @param threadCount the number of threads to run the jobs on
+ * @param backend the backend every job is run on
+ */
+void runJobs(Job* jobs, int count, int threadCount, Backend backend) {
+    JobQueue queue;
+    queue.jobs = jobs;
+    queue.count = count;
+    queue.backend = backend;
+    atomic_init(&queue.next, 0);
+
+    if(threadCount < 1) threadCount = 1;
+    if(threadCount > count) threadCount = count > 0 ? count : 1;
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * threadCount);
+    int started = 0;
+    for(int i = 1; i < threadCount; i++) {
+        if(pthread_create(&threads[started], NULL, worker, &queue) != 0) break;
+        started++;
+    }
+
+    worker(&queue);
+
+    for(int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
@@ -0,0 +1,14 @@
+#ifndef CLOX_RUNNER_H
+#define CLOX_RUNNER_H
+
+#include "vm.h"
+
+typedef struct {
+    const char* source;
+    InterpretResult status;
+    Value result;
+} Job;
+
+void runJobs(Job* jobs, int count, int threadCount, Backend backend);
+
+#endif //CLOX_RUNNER_H
@@ -0,0 +1,130 @@
+/*
+ * The register backend's interpreter loop. Like run.h this is included by vm.c once per variant,
+ * with RUN_FUNCTION naming the function and TRACE_INSTRUCTION() the hook run before each dispatch.
+ */
+
+/**
+ * Executes three-address code for the register backend. The VM stack doubles as the register file,
+ * and the instruction pointer stays in a local which is only written back to the VM on errors.
+ */
+static InterpretResult RUN_FUNCTION(VM* vm) {
+    uint32_t* ip = vm->regChunk->code;
+    Value* registers = vm->stack;
+    Value* constants = vm->regChunk->constants->values;
+    const double* params = vm->params;
+    uint32_t instruction;
+
+#define READ_INSTRUCTION() (instruction = *ip++)
+#define ARITHMETIC_OP(valueType, op, left, right) \
+    do { \
+      Value a = left; \
+      Value b = right; \
+      if(!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+        vm->regIp = ip; \
+        runtimeError(vm, "Operands must be numbers."); \
+        return INTERPREET_RUNTIME_ERROR; \
+      } \
+      registers[REG_A(instruction)] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+#define RR(op) ARITHMETIC_OP(NUMBER_VAL, op, registers[REG_B(instruction)], registers[REG_C(instruction)])
+#define RK(op) ARITHMETIC_OP(NUMBER_VAL, op, registers[REG_B(instruction)], constants[REG_C(instruction)])
+#define KR(op) ARITHMETIC_OP(NUMBER_VAL, op, constants[REG_B(instruction)], registers[REG_C(instruction)])
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+            [ROP_LOADK]       = &&op_ROP_LOADK,
+            [ROP_LOADKX]      = &&op_ROP_LOADKX,
+            [ROP_NEGATE]      = &&op_ROP_NEGATE,
+            [ROP_ADD_RR]      = &&op_ROP_ADD_RR,
+            [ROP_ADD_RK]      = &&op_ROP_ADD_RK,
+            [ROP_ADD_KR]      = &&op_ROP_ADD_KR,
+            [ROP_SUBTRACT_RR] = &&op_ROP_SUBTRACT_RR,
+            [ROP_SUBTRACT_RK] = &&op_ROP_SUBTRACT_RK,
+            [ROP_SUBTRACT_KR] = &&op_ROP_SUBTRACT_KR,
+            [ROP_MULTIPLY_RR] = &&op_ROP_MULTIPLY_RR,
+            [ROP_MULTIPLY_RK] = &&op_ROP_MULTIPLY_RK,
+            [ROP_MULTIPLY_KR] = &&op_ROP_MULTIPLY_KR,
+            [ROP_DIVIDE_RR]   = &&op_ROP_DIVIDE_RR,
+            [ROP_DIVIDE_RK]   = &&op_ROP_DIVIDE_RK,
+            [ROP_DIVIDE_KR]   = &&op_ROP_DIVIDE_KR,
+            [ROP_RETURN]      = &&op_ROP_RETURN,
+            [ROP_LOADPARAM]   = &&op_ROP_LOADPARAM,
+    };
+#define CASE(opcode) op_##opcode:
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatchTable[REG_OP(READ_INSTRUCTION())]; \
+    } while (false)
+
+    DISPATCH();
+#else
+#define CASE(opcode) case opcode:
+#define DISPATCH() continue
+
+    for(;;) {
+        TRACE_INSTRUCTION();
+        switch (REG_OP(READ_INSTRUCTION())) {
+#endif
+            CASE(ROP_LOADK) {
+                registers[REG_A(instruction)] = constants[REG_BX(instruction)];
+                DISPATCH();
+            }
+            CASE(ROP_LOADKX) {
+                registers[REG_A(instruction)] = constants[*ip++];
+                DISPATCH();
+            }
+            CASE(ROP_NEGATE) {
+                Value value = registers[REG_B(instruction)];
+                if(!IS_NUMBER(value)) {
+                    vm->regIp = ip;
+                    runtimeError(vm, "Operand must be a number.");
+                    return INTERPREET_RUNTIME_ERROR;
+                }
+                registers[REG_A(instruction)] = NUMBER_VAL(-AS_NUMBER(value));
+                DISPATCH();
+            }
+            CASE(ROP_ADD_RR) RR(+); DISPATCH();
+            CASE(ROP_ADD_RK) RK(+); DISPATCH();
+            CASE(ROP_ADD_KR) KR(+); DISPATCH();
+            CASE(ROP_SUBTRACT_RR) RR(-); DISPATCH();
+            CASE(ROP_SUBTRACT_RK) RK(-); DISPATCH();
+            CASE(ROP_SUBTRACT_KR) KR(-); DISPATCH();
+            CASE(ROP_MULTIPLY_RR) RR(*); DISPATCH();
+            CASE(ROP_MULTIPLY_RK) RK(*); DISPATCH();
+            CASE(ROP_MULTIPLY_KR) KR(*); DISPATCH();
+            CASE(ROP_DIVIDE_RR) RR(/); DISPATCH();
+            CASE(ROP_DIVIDE_RK) RK(/); DISPATCH();
+            CASE(ROP_DIVIDE_KR) KR(/); DISPATCH();
+            CASE(ROP_RETURN) {
+                vm->result = registers[REG_A(instruction)];
+                if(vm->printResult) {
+                    printValue(vm->result);
+                    printf("\n");
+                }
+                return INTERPRET_OK;
+            }
+            CASE(ROP_LOADPARAM) {
+                if(params == NULL) {
+                    vm->regIp = ip;
+                    runtimeError(vm, "No value given for parameter %d.", REG_B(instruction));
+                    return INTERPREET_RUNTIME_ERROR;
+                }
+                registers[REG_A(instruction)] = NUMBER_VAL(params[REG_B(instruction)]);
+                DISPATCH();
+            }
+#ifndef COMPUTED_GOTO
+        }
+    }
+#endif
+#undef READ_INSTRUCTION
+#undef ARITHMETIC_OP
+#undef RR
+#undef RK
+#undef KR
+#undef CASE
+#undef DISPATCH
+}
+
+#undef RUN_FUNCTION
+#undef TRACE_INSTRUCTION
@@ -1,25 +1,281 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SCANNER_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Skips runs of one class of characters. Each kernel returns a pointer to the first character
+ * past the run. The run always ends at the NUL terminator since it is in none of the classes,
+ * except for comments, which may contain NUL bytes and so are bounded by the end of the source.
+ */
+struct ScanKernels {
+    const char* name;
+    const char* (*skipSpace)(const char* current, int* line);
+    const char* (*skipComment)(const char* current, const char* end);
+    const char* (*skipIdentifier)(const char* current);
+    const char* (*skipDigits)(const char* current);
+};
+
+// Runs shorter than this are cheaper to finish one character at a time than to hand to a kernel.
+#define SHORT_RUN 8
+
+static bool isAlpha(char c);
+static bool isDigit(char c);
+static Token scanBufferedToken(Scanner* scanner);
+
+static const char* skipSpaceScalar(const char* current, int* line) {
+    for(;; current++) {
+        switch(*current) {
+            case '\n': (*line)++; break;
+            case ' ':
+            case '\r':
+            case '\t': break;
+            default: return current;
+        }
+    }
+}
+
+static const char* skipCommentScalar(const char* current, const char* end) {
+    while(current < end && *current != '\n') current++;
+    return current;
+}
+
+static const char* skipIdentifierScalar(const char* current) {
+    while(isAlpha(*current) || isDigit(*current)) current++;
+    return current;
+}
+
+static const char* skipDigitsScalar(const char* current) {
+    while(isDigit(*current)) current++;
+    return current;
+}
+
+static const ScanKernels scalarKernels = {
+        "scalar", skipSpaceScalar, skipCommentScalar, skipIdentifierScalar, skipDigitsScalar,
+};
+
+#ifdef SCANNER_X86
+/*
+ * The vector kernels classify a whole block at a time and find the end of the run with a bit scan
+ * of the mask of bytes outside the class. Loads are aligned, so a block never crosses into the next
+ * page and reading the rest of the block past the NUL terminator cannot fault. Bytes of the first
+ * block which come before the run are masked off.
+ */
+#define LOW_BITS(count) ((count) >= 32 ? 0xffffffffu : (1u << (count)) - 1)
+
+#define SCAN_KERNELS(isa, feature, vector, width, load, set1, cmpeq, cmpgt, or, and, movemask) \
+    __attribute__((target(feature))) \
+    static const char* skipSpace##isa(const char* current, int* line) { \
+        const char* block = (const char*)((uintptr_t)current & ~(uintptr_t)(width - 1)); \
+        uint32_t before = LOW_BITS((uint32_t)(current - block)); \
+        for(;;) { \
+            vector bytes = load((const vector*)block); \
+            uint32_t newlines = (uint32_t)movemask(cmpeq(bytes, set1('\n'))) & ~before; \
+            uint32_t space = (uint32_t)movemask(or(or(cmpeq(bytes, set1(' ')), cmpeq(bytes, set1('\t'))), \
+                                                  cmpeq(bytes, set1('\r')))); \
+            uint32_t stop = ~(space | newlines | before) & LOW_BITS(width); \
+            if(stop != 0) { \
+                int end = __builtin_ctz(stop); \
+                *line += __builtin_popcount(newlines & LOW_BITS(end)); \
+                return block + end; \
+            } \
+            *line += __builtin_popcount(newlines); \
+            block += width; \
+            before = 0; \
+        } \
+    } \
+    __attribute__((target(feature))) \
+    static const char* skipComment##isa(const char* current, const char* end) { \
+        const char* block = (const char*)((uintptr_t)current & ~(uintptr_t)(width - 1)); \
+        uint32_t before = LOW_BITS((uint32_t)(current - block)); \
+        for(;;) { \
+            vector bytes = load((const vector*)block); \
+            uint32_t stop = (uint32_t)movemask(cmpeq(bytes, set1('\n'))) & ~before; \
+            if(stop != 0) { \
+                const char* newline = block + __builtin_ctz(stop); \
+                return newline < end ? newline : end; \
+            } \
+            block += width; \
+            if(block >= end) return end; \
+            before = 0; \
+        } \
+    } \
+    __attribute__((target(feature))) \
+    static const char* skipIdentifier##isa(const char* current) { \
+        const char* block = (const char*)((uintptr_t)current & ~(uintptr_t)(width - 1)); \
+        uint32_t before = LOW_BITS((uint32_t)(current - block)); \
+        for(;;) { \
+            vector bytes = load((const vector*)block); \
+            vector lower = or(bytes, set1(0x20)); \
+            vector alpha = and(cmpgt(lower, set1('a' - 1)), cmpgt(set1('z' + 1), lower)); \
+            vector digit = and(cmpgt(bytes, set1('0' - 1)), cmpgt(set1('9' + 1), bytes)); \
+            vector word = or(or(alpha, digit), cmpeq(bytes, set1('_'))); \
+            uint32_t stop = ~((uint32_t)movemask(word) | before) & LOW_BITS(width); \
+            if(stop != 0) return block + __builtin_ctz(stop); \
+            block += width; \
+            before = 0; \
+        } \
+    } \
+    __attribute__((target(feature))) \
+    static const char* skipDigits##isa(const char* current) { \
+        const char* block = (const char*)((uintptr_t)current & ~(uintptr_t)(width - 1)); \
+        uint32_t before = LOW_BITS((uint32_t)(current - block)); \
+        for(;;) { \
+            vector bytes = load((const vector*)block); \
+            vector digit = and(cmpgt(bytes, set1('0' - 1)), cmpgt(set1('9' + 1), bytes)); \
+            uint32_t stop = ~((uint32_t)movemask(digit) | before) & LOW_BITS(width); \
+            if(stop != 0) return block + __builtin_ctz(stop); \
+            block += width; \
+            before = 0; \
+        } \
+    } \
+    static const ScanKernels isa##Kernels = { \
+            #isa, skipSpace##isa, skipComment##isa, skipIdentifier##isa, skipDigits##isa, \
+    };
+
+SCAN_KERNELS(sse2, "sse2", __m128i, 16, _mm_load_si128, _mm_set1_epi8, _mm_cmpeq_epi8, _mm_cmpgt_epi8,
+             _mm_or_si128, _mm_and_si128, _mm_movemask_epi8)
+SCAN_KERNELS(avx2, "avx2", __m256i, 32, _mm256_load_si256, _mm256_set1_epi8, _mm256_cmpeq_epi8,
+             _mm256_cmpgt_epi8, _mm256_or_si256, _mm256_and_si256, _mm256_movemask_epi8)
+#endif
 
-Scanner scanner;
+/**
+ * Picks the widest kernels the CPU supports. CLOX_SCANNER_KERNELS can name a narrower set
+ * (scalar, sse2 or avx2) to compare them; a set the CPU lacks is never picked.
+ * @return the kernels the scanner skips runs of characters with
+ */
+static const ScanKernels* selectKernels(void) {
+    const char* requested = getenv("CLOX_SCANNER_KERNELS");
+    if(requested != NULL && strcmp(requested, "scalar") == 0) return &scalarKernels;
+#ifdef SCANNER_X86
+    bool wantAvx2 = requested == NULL || strcmp(requested, "avx2") == 0;
+    if(wantAvx2 && __builtin_cpu_supports("avx2")) return &avx2Kernels;
+    if(__builtin_cpu_supports("sse2")) return &sse2Kernels;
+#endif
+    return &scalarKernels;
+}
 
 /**
- * Sets start and current to beginning of source and line to 1.
+ * Sets start and current to beginning of source and line to 1 and picks the kernels for this CPU.
+ * The scanner stops at source + length. Bytes before that are scanned even if they are NUL, but the
+ * byte at source + length must be a NUL so that the kernels stop there too.
+ * @param scanner the scanner to initialize
  * @param source the pointer to source text
+ * @param length the length of the source text
+ */
+void initScanner(Scanner* scanner, const char* source, size_t length) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->end = source + length;
+    scanner->line = 1;
+    scanner->kernels = selectKernels();
+    scanner->stream = NULL;
+    scanner->buffer = NULL;
+    scanner->bufferSize = 0;
+    scanner->streamEnded = true;
+    scanner->pinned = NULL;
+}
+
+/**
+ * Sets up a scanner which reads its source from a stream through a buffer of a fixed size, so that
+ * sources of any length are scanned in constant memory. Tokens point into the buffer and stay valid
+ * until the next call to scanToken, except for a pinned token which stays valid one call longer.
+ * @param scanner the scanner to initialize
+ * @param stream the stream to read the source from
+ * @param bufferSize the size of the buffer, twice the length of the longest token allowed
+ */
+void initStreamScanner(Scanner* scanner, FILE* stream, size_t bufferSize) {
+    // The kernels load whole aligned blocks, so the buffer starts on a block and is padded past
+    // the terminator by one.
+    char* buffer = aligned_alloc(64, (bufferSize + 64 + 63) & ~(size_t)63);
+    if(buffer == NULL) exit(1);
+    buffer[0] = '\0';
+    initScanner(scanner, buffer, 0);
+    scanner->stream = stream;
+    scanner->buffer = buffer;
+    scanner->bufferSize = bufferSize;
+    scanner->streamEnded = false;
+}
+
+void freeStreamScanner(Scanner* scanner) {
+    free(scanner->buffer);
+    scanner->buffer = NULL;
+}
+
+/**
+ * Keeps a token the caller holds on to valid when the buffer is refilled. Its text is moved along
+ * with the rest of the buffer and its start pointer is rebased to match.
+ * @param scanner a stream scanner
+ * @param token the caller's copy of the token, usually the parser's previous token
+ */
+void pinToken(Scanner* scanner, Token* token) {
+    scanner->pinned = token;
+}
+
+/**
+ * Moves the parts of the buffer which are still needed to its front and fills the rest from the
+ * stream. Those are the text of the pinned token and everything from the current position on, so
+ * the whitespace between them never has to fit in the buffer. Only called between tokens.
+ * @param scanner a stream scanner
+ */
+static void refill(Scanner* scanner) {
+    char* next = scanner->buffer;
+    Token* pinned = scanner->pinned;
+    if(pinned != NULL && pinned->start >= scanner->buffer && pinned->start <= scanner->end) {
+        memmove(next, pinned->start, pinned->length);
+        pinned->start = next;
+        next += pinned->length;
+    }
+
+    size_t unread = (size_t)(scanner->end - scanner->current);
+    memmove(next, scanner->current, unread);
+    scanner->current = next;
+    scanner->start = next;
+    char* end = next + unread;
+
+    // A token is shorter than half the buffer, so there is always room to read into.
+    size_t read = fread(end, 1, scanner->bufferSize - (size_t)(end - scanner->buffer), scanner->stream);
+    end += read;
+    *end = '\0';
+    scanner->end = end;
+    if(read == 0) scanner->streamEnded = true;
+}
+
+/**
+ * Makes sure that at least count bytes of a stream are in the buffer past the current position,
+ * unless the stream ends first. Does nothing for a scanner over a string.
+ * @param scanner the scanner reading the source
+ * @param count the number of bytes needed
+ */
+static void reserve(Scanner* scanner, size_t count) {
+    while(!scanner->streamEnded && (size_t)(scanner->end - scanner->current) < count) {
+        refill(scanner);
+    }
+}
+
+/**
+ * @param scanner the scanner reading the source
+ * @return true if the scanner stopped at the end of its buffer and more of the stream was read
+ */
+static bool refillAtEnd(Scanner* scanner) {
+    if(scanner->streamEnded || scanner->current != scanner->end) return false;
+    refill(scanner);
+    return scanner->current != scanner->end;
+}
+
+/**
+ * @param scanner an initialized scanner
+ * @return the name of the kernels the scanner uses to skip runs of characters
  */
-void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+const char* scannerKernelName(Scanner* scanner) {
+    return scanner->kernels->name;
 }
 
 /**
@@ -41,95 +297,112 @@ static bool isDigit(char c) {
 }
 
 /**
- * @return true if at '\0' false otherwise
+ * @param scanner the scanner reading the source
+ * @return true if the whole source has been scanned, false otherwise
  */
-static bool isAtEnd() {
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+    return scanner->current >= scanner->end;
 }
 
 /**
  * Returns the value at the current pointer and then increments the current pointer.
+ * @param scanner the scanner reading the source
  * @return the char at the current pointer.
  */
-static char advance() {
-    return *scanner.current++;
+static char advance(Scanner* scanner) {
+    return *scanner->current++;
 }
 
 /**
+ * @param scanner the scanner reading the source
  * @return the char at the current source text pointer
  */
-static char peek() {
-    return *scanner.current;
+static char peek(Scanner* scanner) {
+    return *scanner->current;
 }
 
 /**
+ * @param scanner the scanner reading the source
  * @return the value of the char at next location or '\0' if at end of text
  */
-static char peekNext() {
-    if(isAtEnd()) return '\0';
-    return *(scanner.current + 1);
+static char peekNext(Scanner* scanner) {
+    if(isAtEnd(scanner)) return '\0';
+    return *(scanner->current + 1);
 }
 
 /**
  * Checks if the current location in the source text is the same as a char. If matched then
  * increments the scanners current pointer.
+ * @param scanner the scanner reading the source
  * @param expected the char to compare to the current source char
  * @return true or false depending on if it matched.
  */
-static bool match(char expected) {
-    if(isAtEnd()) return false;
-    if(*scanner.current != expected) return false;
-    scanner.current++;
+static bool match(Scanner* scanner, char expected) {
+    if(isAtEnd(scanner)) return false;
+    if(*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
 
 /**
  * Creates a token.
+ * @param scanner the scanner reading the source
  * @param type the type of the token.
  * @return the created token.
  */
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
 /**
  * Creates an error token.
+ * @param scanner the scanner reading the source
  * @param message the message that the error token holds.
  * @return the error token
  */
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
 /**
- * Skips all whitespaces increments line information and skips comments.
+ * Skips all whitespaces increments line information and skips comments. Short runs of whitespace
+ * are handled here, longer runs and comments go to the kernels.
+ * @param scanner the scanner reading the source
  */
-static void skipWhitespace() {
+static void skipWhitespace(Scanner* scanner) {
     for(;;) {
-        char c = peek();
+        // Two bytes, so that a "//" split across two reads is still seen as a comment.
+        reserve(scanner, 2);
+        char c = peek(scanner);
         switch(c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
-                break;
             case '\n':
-                scanner.line++;
-                advance();
+                for(int i = 0; i < SHORT_RUN && (c == ' ' || c == '\r' || c == '\t' || c == '\n'); i++) {
+                    if(c == '\n') scanner->line++;
+                    advance(scanner);
+                    c = peek(scanner);
+                }
+                if(c == ' ' || c == '\r' || c == '\t' || c == '\n') {
+                    scanner->current = scanner->kernels->skipSpace(scanner->current, &scanner->line);
+                }
                 break;
             case '/':
-                if(peekNext() == '/') {
-                    while(peek() != '\n' && !isAtEnd()) advance();
+                if(peekNext(scanner) == '/') {
+                    do {
+                        scanner->current = scanner->kernels->skipComment(scanner->current, scanner->end);
+                    } while(refillAtEnd(scanner));
                 } else {
                     return;
                 } break;
@@ -139,142 +412,195 @@ static void skipWhitespace() {
     }
 }
 
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+/*
+ * Every keyword lands in its own slot under keywordHash, so a lookup is one hash, one length check
+ * and at most one memcmp. The multipliers were found by trying small values until the keywords
+ * stopped colliding; they have to be searched for again when a keyword is added.
+ */
+#define KEYWORD_SLOTS 32
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+        [0]  = {"true",   4, TOKEN_TRUE},
+        [2]  = {"for",    3, TOKEN_FOR},
+        [5]  = {"else",   4, TOKEN_ELSE},
+        [6]  = {"print",  5, TOKEN_PRINT},
+        [7]  = {"or",     2, TOKEN_OR},
+        [9]  = {"if",     2, TOKEN_IF},
+        [12] = {"this",   4, TOKEN_THIS},
+        [13] = {"class",  5, TOKEN_CLASS},
+        [14] = {"fun",    3, TOKEN_FUN},
+        [15] = {"super",  5, TOKEN_SUPER},
+        [22] = {"var",    3, TOKEN_VAR},
+        [24] = {"return", 6, TOKEN_RETURN},
+        [25] = {"while",  5, TOKEN_WHILE},
+        [26] = {"false",  5, TOKEN_FALSE},
+        [27] = {"and",    3, TOKEN_AND},
+        [30] = {"nil",    3, TOKEN_NIL},
+};
+
 /**
- * Determines if the current part of the source string is of a certain token type.
- * @param start the length of the part of the keyword we know matches
- * @param length the length of the part of the keyword that remains to be matched
- * @param rest the text of the remaining part of keyword that remains to be matched
- * @param type the TokenType of the keyword we are matching for
- * @return the correct TokenType of the token.
+ * @param start the first character of a word of at least two characters
+ * @param length the length of the word
+ * @return the only slot of keywords the word can be in
  */
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if(scanner.current - scanner.start == start + length &&
-       memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
-    } else {
-        return TOKEN_IDENTIFIER;
-    }
+static int keywordHash(const char* start, int length) {
+    return ((unsigned char)start[0] + 2 * (unsigned char)start[1] + 10 * length) & (KEYWORD_SLOTS - 1);
 }
 
 /**
- * Determines if the token that starts at *scanner.start is an identifier or a keyword.
- * @return the TokenType of the token.
+ * Looks a word up in the keyword table.
+ * @param start the first character of the word
+ * @param length the length of the word
+ * @return the TokenType of the keyword, or TOKEN_IDENTIFIER if the word is not one
  */
-static TokenType identifierType() {
-    switch (*scanner.start) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if(scanner.current - scanner.start > 1) {
-                switch(*scanner.start) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+TokenType keywordType(const char* start, int length) {
+    if(length < 2 || length > 6) return TOKEN_IDENTIFIER;
+
+    const Keyword* keyword = &keywords[keywordHash(start, length)];
+    if(keyword->length == length && memcmp(start, keyword->name, length) == 0) {
+        return keyword->type;
     }
     return TOKEN_IDENTIFIER;
 }
 
+/**
+ * Determines if the token that starts at *scanner->start is an identifier or a keyword.
+ * @param scanner the scanner reading the source
+ * @return the TokenType of the token.
+ */
+static TokenType identifierType(Scanner* scanner) {
+    return keywordType(scanner->start, (int)(scanner->current - scanner->start));
+}
+
 /**
  * Builds a TOKEN_IDENTIFIER or keyword token from the data that starts at the current source pointer.
+ * @param scanner the scanner reading the source
  * @return the identifier or keyword token that is built.
  */
-static Token identifier() {
-    while(isAlpha(peek()) || isDigit(peek())) advance();
-    return makeToken(identifierType());
+static Token identifier(Scanner* scanner) {
+    for(int i = 0; i < SHORT_RUN; i++) {
+        if(!isAlpha(peek(scanner)) && !isDigit(peek(scanner))) {
+            return makeToken(scanner, identifierType(scanner));
+        }
+        advance(scanner);
+    }
+    scanner->current = scanner->kernels->skipIdentifier(scanner->current);
+    return makeToken(scanner, identifierType(scanner));
+}
+
+/**
+ * Advances past a run of digits, short runs one character at a time and longer ones with the kernel.
+ * @param scanner the scanner reading the source
+ */
+static void skipDigits(Scanner* scanner) {
+    for(int i = 0; i < SHORT_RUN; i++) {
+        if(!isDigit(peek(scanner))) return;
+        advance(scanner);
+    }
+    scanner->current = scanner->kernels->skipDigits(scanner->current);
 }
 
 /**
  * Builds a TOKEN_NUMBER from the data that starts at the current source pointer.
+ * @param scanner the scanner reading the source
  * @return the number token that is built.
  */
-static Token number() {
-    while(isDigit(peek())) advance();
+static Token number(Scanner* scanner) {
+    skipDigits(scanner);
 
-    if(peek() == '.' && isDigit(peekNext())) {
-        advance();
+    if(peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+        advance(scanner);
 
-        while(isDigit(peek())) advance();
+        skipDigits(scanner);
     }
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
 /**
  * Builds a TOKEN_STRING from the data that starts at the current source pointer.
+ * @param scanner the scanner reading the source
  * @return the string token that is created or an error token if the string is unterminated.
  */
-static Token string() {
-    while(peek() != '"' && !isAtEnd()) {
-        if(peek() == '\n') scanner.line++;
+static Token string(Scanner* scanner) {
+    while(peek(scanner) != '"' && !isAtEnd(scanner)) {
+        if(peek(scanner) == '\n') scanner->line++;
     }
-    if(isAtEnd()) return errorToken("Unterminated string.");
+    if(isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
+}
+
+/**
+ * Scans the source code for the very next token. On a stream, half a buffer is read ahead first so
+ * that the token cannot run past the data in the buffer unless it is too long.
+ * @param scanner the scanner reading the source
+ * @return the next token in the source code.
+ */
+Token scanToken(Scanner* scanner) {
+    if(scanner->stream == NULL) return scanBufferedToken(scanner);
+
+    skipWhitespace(scanner);
+    reserve(scanner, scanner->bufferSize / 2);
+    Token token = scanBufferedToken(scanner);
+    // Checking the length rather than whether the token ran into the end of the buffer makes the
+    // limit independent of how the stream happens to be read, and leaves room for the next refill.
+    if(token.type != TOKEN_ERROR && (size_t)token.length >= scanner->bufferSize / 2) {
+        return errorToken(scanner, "Token too long.");
+    }
+    return token;
 }
 
 /**
- * Scans the source code for the very next token.
+ * Scans the next token out of the source already in memory.
+ * @param scanner the scanner reading the source
  * @return the next token in the source code.
  */
-Token scanToken() {
-    skipWhitespace();
-    scanner.start = scanner.current;
+static Token scanBufferedToken(Scanner* scanner) {
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if(isAtEnd()) {
-        return makeToken(TOKEN_EOF);
+    if(isAtEnd(scanner)) {
+        return makeToken(scanner, TOKEN_EOF);
     }
 
-    char c = advance();
+    char c = advance(scanner);
 
-    if(isAlpha(c)) return identifier();
-    if(isDigit(c)) return number();
+    if(isAlpha(c)) return identifier(scanner);
+    if(isDigit(c)) return number(scanner);
 
     switch (c) {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
+        case '+': return makeToken(scanner, TOKEN_PLUS);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+        case '*': return makeToken(scanner, TOKEN_STAR);
         case '!':
-            return makeToken(
-                    match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return makeToken(scanner,
+                    match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=':
-            return makeToken(
-                    match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return makeToken(scanner,
+                    match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<':
-            return makeToken(
-                    match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return makeToken(scanner,
+                    match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         case '>':
-            return makeToken(
-                    match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-        case '"': return string();
+            return makeToken(scanner,
+                    match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        case '"': return string(scanner);
     }
 
-    return errorToken("unexpected character.");
+    return errorToken(scanner, "unexpected character.");
 }
\ No newline at end of file
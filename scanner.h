@@ -1,6 +1,10 @@
 #ifndef CLOX_SCANNER_H
 #define CLOX_SCANNER_H
 
+#include <stdio.h>
+
+#include "common.h"
+
 typedef enum {
     // Single-character tokens.
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
@@ -30,8 +34,33 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+typedef struct ScanKernels ScanKernels;
+
+// The default size of the buffer a stream is scanned through. No token may be longer than half of it.
+#define STREAM_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    const char* start;
+    const char* current;
+    // The source ends here, whatever it contains. A NUL byte must follow for the scan kernels.
+    const char* end;
+    int line;
+    const ScanKernels* kernels;
+    // Only used when scanning a stream. The source is then the part of buffer before end.
+    FILE* stream;
+    char* buffer;
+    size_t bufferSize;
+    bool streamEnded;
+    Token* pinned;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source, size_t length);
+void initStreamScanner(Scanner* scanner, FILE* stream, size_t bufferSize);
+void freeStreamScanner(Scanner* scanner);
+void pinToken(Scanner* scanner, Token* token);
+Token scanToken(Scanner* scanner);
+const char* scannerKernelName(Scanner* scanner);
+TokenType keywordType(const char* start, int length);
 
 
 #endif //CLOX_SCANNER_H
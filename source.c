@@ -0,0 +1,114 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+/**
+ * Maps a regular file so that the scanner reads it in place. Zeroed anonymous pages are reserved
+ * first and the file is mapped over the front of them, which leaves at least one zero byte after
+ * the text even when the file exactly fills its last page.
+ * @param source the source to fill
+ * @param fd the open file
+ * @param length the size of the file
+ * @return false if the file could not be mapped
+ */
+static bool mapSource(Source* source, int fd, size_t length) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (length / page + 1) * page;
+    char* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED) return false;
+
+    if(length > 0) {
+        if(mmap(mapping, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(mapping, size);
+            return false;
+        }
+        madvise(mapping, length, MADV_SEQUENTIAL);
+    }
+
+    source->text = mapping;
+    source->length = length;
+    source->mapping = mapping;
+    source->mappingSize = size;
+    return true;
+}
+
+/**
+ * Reads everything left in a file which cannot be mapped, such as a pipe or a terminal, into a
+ * heap buffer that grows as needed.
+ * @param source the source to fill
+ * @param fd the open file
+ * @return false if reading failed
+ */
+static bool readSource(Source* source, int fd) {
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* buffer = malloc(capacity);
+    if(buffer == NULL) return false;
+
+    for(;;) {
+        if(capacity - length < 2) {
+            capacity *= 2;
+            char* grown = realloc(buffer, capacity);
+            if(grown == NULL) {
+                free(buffer);
+                return false;
+            }
+            buffer = grown;
+        }
+
+        ssize_t count = read(fd, buffer + length, capacity - length - 1);
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0) {
+            free(buffer);
+            return false;
+        }
+        if(count == 0) break;
+        length += (size_t)count;
+    }
+
+    buffer[length] = '\0';
+    source->text = buffer;
+    source->length = length;
+    source->mapping = NULL;
+    source->mappingSize = 0;
+    return true;
+}
+
+/**
+ * Loads the source of a script. Regular files are mapped rather than copied, so a large script
+ * is not held in memory twice and scanning starts without reading it all first. Anything else is
+ * read into a buffer.
+ * @param source the source to fill, released with freeSource()
+ * @param path the path of the script, or "-" for standard input
+ * @return false if the script could not be opened or read
+ */
+bool loadSource(Source* source, const char* path) {
+    bool isStdin = strcmp(path, "-") == 0;
+    int fd = isStdin ? STDIN_FILENO : open(path, O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat status;
+    bool loaded = false;
+    if(fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && !isStdin) {
+        loaded = mapSource(source, fd, (size_t)status.st_size);
+    }
+    if(!loaded) loaded = readSource(source, fd);
+
+    if(!isStdin) close(fd);
+    return loaded;
+}
+
+void freeSource(Source* source) {
+    if(source->mapping != NULL) {
+        munmap(source->mapping, source->mappingSize);
+    } else {
+        free((char*)source->text);
+    }
+    source->text = NULL;
+}
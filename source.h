@@ -0,0 +1,20 @@
+#ifndef CLOX_SOURCE_H
+#define CLOX_SOURCE_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+typedef struct {
+    // The text is always followed by a NUL byte, as the scanner requires.
+    const char* text;
+    size_t length;
+    // The mapping the text lives in, or NULL if it was read into a heap buffer.
+    void* mapping;
+    size_t mappingSize;
+} Source;
+
+bool loadSource(Source* source, const char* path);
+void freeSource(Source* source);
+
+#endif //CLOX_SOURCE_H
@@ -0,0 +1,96 @@
+// fopencookie is a GNU extension.
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "trace.h"
+
+#ifdef __GLIBC__
+/**
+ * Write callback of the ring's stream. Bytes past the end of the buffer wrap around to its start,
+ * overwriting the oldest output.
+ * @param cookie the TraceRing
+ * @param buffer the bytes being written
+ * @param size the number of bytes
+ * @return size, the ring always takes everything
+ */
+static ssize_t writeRing(void* cookie, const char* buffer, size_t size) {
+    TraceRing* ring = (TraceRing*)cookie;
+    ssize_t written = (ssize_t)size;
+
+    if(size > ring->size) {
+        buffer += size - ring->size;
+        size = ring->size;
+    }
+    while(size > 0) {
+        size_t part = ring->size - ring->next < size ? ring->size - ring->next : size;
+        memcpy(ring->data + ring->next, buffer, part);
+        ring->next += part;
+        if(ring->next == ring->size) {
+            ring->next = 0;
+            ring->full = true;
+        }
+        buffer += part;
+        size -= part;
+    }
+    return written;
+}
+#endif
+
+/**
+ * Opens a stream which keeps the last size bytes written to it in memory.
+ * @param ring the ring to open, its stream is ring->file
+ * @param size the number of bytes to keep
+ * @return false if the platform has no way to make such a stream
+ */
+bool openTraceRing(TraceRing* ring, size_t size) {
+#ifdef __GLIBC__
+    ring->data = malloc(size);
+    ring->size = size;
+    ring->next = 0;
+    ring->full = false;
+
+    cookie_io_functions_t functions = {NULL, writeRing, NULL, NULL};
+    ring->file = ring->data == NULL ? NULL : fopencookie(ring, "w", functions);
+    if(ring->file == NULL) {
+        free(ring->data);
+        return false;
+    }
+    return true;
+#else
+    (void)ring;
+    (void)size;
+    return false;
+#endif
+}
+
+/**
+ * Writes what the ring holds, oldest first. Once the ring has wrapped around, the line cut in half
+ * by the wrap is skipped.
+ * @param ring the ring to dump
+ * @param out the stream to write to
+ */
+void dumpTraceRing(TraceRing* ring, FILE* out) {
+    fflush(ring->file);
+    if(!ring->full) {
+        fwrite(ring->data, 1, ring->next, out);
+        return;
+    }
+
+    size_t start = ring->next;
+    while(start < ring->size && ring->data[start] != '\n') start++;
+    if(start < ring->size) {
+        fwrite(ring->data + start + 1, 1, ring->size - start - 1, out);
+        fwrite(ring->data, 1, ring->next, out);
+    } else {
+        char* newline = memchr(ring->data, '\n', ring->next);
+        if(newline != NULL) fwrite(newline + 1, 1, ring->data + ring->next - newline - 1, out);
+    }
+}
+
+void closeTraceRing(TraceRing* ring) {
+    fclose(ring->file);
+    free(ring->data);
+}
@@ -0,0 +1,24 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+ * A stream which keeps only the last size bytes written to it, so that tracing can stay on for a
+ * long run and still show what led up to a failure.
+ */
+typedef struct {
+    char* data;
+    size_t size;
+    size_t next;
+    bool full;
+    FILE* file;
+} TraceRing;
+
+bool openTraceRing(TraceRing* ring, size_t size);
+void dumpTraceRing(TraceRing* ring, FILE* out);
+void closeTraceRing(TraceRing* ring);
+
+#endif //CLOX_TRACE_H
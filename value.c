@@ -4,25 +4,28 @@
 #include "value.h"
 
 /**
- * Initializes the double pointer array to NULL and sets capacity and count of valueArray to 0.
+ * Initializes the values pointer to NULL and sets capacity and count of valueArray to 0.
  * @param array the value array* to be initialized
+ * @param allocator the allocator the values are kept in
  */
-void initValueArray(ValueArray* array) {
+void initValueArray(ValueArray* array, Allocator* allocator) {
     array->values = NULL;
     array->capacity = 0;
     array->count = 0;
+    array->allocator = allocator;
 }
 
 /**
- * Adds a double to the end of a value array.
+ * Adds a value to the end of a value array.
  * @param array the array to append to value to
- * @param value the double added to the end of the array.
+ * @param value the value added to the end of the array.
  */
 void writeValueArray(ValueArray* array, Value value) {
     if(array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(array->allocator, MEMORY_CONSTANTS, Value, array->values,
+                                   oldCapacity, array->capacity);
     }
 
     array->values[array->count] = value;
@@ -34,14 +37,76 @@ void writeValueArray(ValueArray* array, Value value) {
  * @param array pointer to the ValueArray who's memory is to be freed
  */
 void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
-    initValueArray(array);
+    FREE_ARRAY(array->allocator, MEMORY_CONSTANTS, Value, array->values, array->capacity);
+    initValueArray(array, array->allocator);
 }
 
 /**
- * Prints out a value with precision corresponding to the precision of the value
- * @param value the double to be printed
+ * Prints out a value to stdout. Numbers are printed with precision corresponding to the precision of the value.
+ * @param value the value to be printed
  */
 void printValue(Value value) {
-    printf("%g", value);
+    fprintValue(stdout, value);
+}
+
+/**
+ * Prints out a value the same way as printValue, to any stream.
+ * @param file the stream to print to
+ * @param value the value to be printed
+ */
+void fprintValue(FILE* file, Value value) {
+    if(IS_BOOL(value)) {
+        fprintf(file, AS_BOOL(value) ? "true" : "false");
+    } else if(IS_NIL(value)) {
+        fprintf(file, "nil");
+    } else {
+        fprintf(file, "%g", AS_NUMBER(value));
+    }
+}
+
+/**
+ * Compares two values bit for bit. Unlike ==, -0 and 0 are different and a NaN is identical to
+ * itself, which is what a constant pool needs to tell literals apart.
+ * @param a the first value
+ * @param b the second value
+ * @return true if both values have the same type and representation
+ */
+bool valuesIdentical(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if(a.type != b.type) return false;
+    switch (a.type) {
+        case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NIL: return true;
+        case VAL_NUMBER: {
+            double x = AS_NUMBER(a);
+            double y = AS_NUMBER(b);
+            return memcmp(&x, &y, sizeof(double)) == 0;
+        }
+    }
+    return false;
+#endif
+}
+
+/**
+ * Hashes the representation of a value so that identical values hash the same.
+ * @param value the value to hash
+ * @return the 32 bit hash of the value
+ */
+uint32_t hashValue(Value value) {
+    uint64_t bits;
+#ifdef NAN_BOXING
+    bits = value;
+#else
+    double number = IS_NUMBER(value) ? AS_NUMBER(value) : 0;
+    memcpy(&bits, &number, sizeof(double));
+    bits ^= ((uint64_t)value.type << 1) | (IS_BOOL(value) && AS_BOOL(value));
+#endif
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
 }
\ No newline at end of file
@@ -1,19 +1,103 @@
 #ifndef CLOX_VALUE_H
 #define CLOX_VALUE_H
 
+#include <stdio.h>
+#include <string.h>
+
 #include "common.h"
+#include "memory.h"
+
+#ifdef NAN_BOXING
+
+// Every double whose exponent bits are all set and whose quiet bit and the bit
+// below it are set is a NaN the hardware never produces on its own, so the low
+// bits of that space are free to tag the non-number values.
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE  3 // 11.
+
+typedef uint64_t Value;
+
+#define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUMBER(value)    valueToNum(value)
+
+#define BOOL_VAL(b)         ((b) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_VAL(num)     numToValue(num)
+
+/**
+ * Reinterprets the bits of a boxed value as a double.
+ * @param value the value which holds a number
+ * @return the double stored in the value
+ */
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+/**
+ * Reinterprets the bits of a double as a boxed value.
+ * @param num the double to box
+ * @return the value holding the number
+ */
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
+typedef enum {
+    VAL_BOOL,
+    VAL_NIL,
+    VAL_NUMBER,
+} ValueType;
+
+typedef struct {
+    ValueType type;
+    union {
+        bool boolean;
+        double number;
+    } as;
+} Value;
+
+#define IS_BOOL(value)      ((value).type == VAL_BOOL)
+#define IS_NIL(value)       ((value).type == VAL_NIL)
+#define IS_NUMBER(value)    ((value).type == VAL_NUMBER)
+
+#define AS_BOOL(value)      ((value).as.boolean)
+#define AS_NUMBER(value)    ((value).as.number)
+
+#define BOOL_VAL(value)     ((Value){VAL_BOOL, {.boolean = value}})
+#define NIL_VAL             ((Value){VAL_NIL, {.number = 0}})
+#define NUMBER_VAL(value)   ((Value){VAL_NUMBER, {.number = value}})
 
-typedef double Value;
+#endif
 
 typedef struct {
     int capacity;
     int count;
     Value* values;
+    Allocator* allocator;
 } ValueArray;
 
-void initValueArray(ValueArray* array);
+void initValueArray(ValueArray* array, Allocator* allocator);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
+void fprintValue(FILE* file, Value value);
+bool valuesIdentical(Value a, Value b);
+uint32_t hashValue(Value value);
 
 #endif //CLOX_VALUE_H
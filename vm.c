@@ -1,105 +1,298 @@
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "debug.h"
 #include "vm.h"
 #include "common.h"
 #include "compiler.h"
+#include "jit.h"
+#include "profile.h"
 
-VM vm;
 
-static void resetStack() {
-    vm.stackTop = vm.stack;
-}
+#ifdef PROFILE_OPCODE_PAIRS
+typedef struct {
+    uint8_t first;
+    uint8_t second;
+    uint64_t count;
+} OpcodePair;
 
-void initVM() {
-    resetStack();
+static int compareOpcodePairs(const void* a, const void* b) {
+    uint64_t countA = ((const OpcodePair*)a)->count;
+    uint64_t countB = ((const OpcodePair*)b)->count;
+    return countA < countB ? 1 : countA > countB ? -1 : 0;
 }
 
-void freeVM() {
+/**
+ * Prints every opcode pair the VM has executed so far to stderr, most frequent first. These are the
+ * candidates for new superinstructions.
+ */
+static void printOpcodePairs(VM* vm) {
+    OpcodePair* pairs = malloc(sizeof(OpcodePair) * (UINT8_MAX + 1) * (UINT8_MAX + 1));
+    int count = 0;
+    uint64_t total = 0;
+    for(int first = 0; first <= UINT8_MAX; first++) {
+        for(int second = 0; second <= UINT8_MAX; second++) {
+            if(vm->opcodePairs[first][second] == 0) continue;
+            pairs[count++] = (OpcodePair){(uint8_t)first, (uint8_t)second, vm->opcodePairs[first][second]};
+            total += vm->opcodePairs[first][second];
+        }
+    }
+    qsort(pairs, count, sizeof(OpcodePair), compareOpcodePairs);
 
+    fprintf(stderr, "== opcode pairs ==\n");
+    for(int i = 0; i < count; i++) {
+        fprintf(stderr, "%12llu %6.2f%%  %s -> %s\n", (unsigned long long)pairs[i].count,
+                100.0 * (double)pairs[i].count / (double)total,
+                opcodeName(pairs[i].first), opcodeName(pairs[i].second));
+    }
+    free(pairs);
 }
+#endif
 
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+static void resetStack(VM* vm) {
+    vm->stackTop = vm->stack;
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+/**
+ * Makes sure the stack has room for a number of values. This is the one check the stack gets, run
+ * before the loop starts, so that push and pop in the loop can stay unchecked.
+ * @param vm the VM about to run
+ * @param slots the largest number of values the code will have on the stack
+ */
+static void reserveStack(VM* vm, int slots) {
+    if(slots <= vm->stackCapacity) return;
+
+    int oldCapacity = vm->stackCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if(capacity < slots) capacity = slots;
+    vm->stack = GROW_ARRAY(&heapAllocator, MEMORY_VM, Value, vm->stack, oldCapacity, capacity);
+    vm->stackCapacity = capacity;
+    resetStack(vm);
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define BINARY_OP(op) \
-    do { \
-      double b = pop(); \
-      double a = pop(); \
-      push(a op b); \
-    } while (false)
+static void runtimeError(VM* vm, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
 
+    int line;
+    if(vm->regChunk != NULL) {
+        line = vm->regChunk->lines[vm->regIp - vm->regChunk->code - 1];
+    } else {
+        line = getLine(vm->chunk, (int)(vm->ip - vm->chunk->code - 1));
+    }
+    fprintf(stderr, "[line %d] in script\n", line);
+    resetStack(vm);
+}
 
-#ifdef DEBUG_TRACE_EXECUTION
+void initVM(VM* vm) {
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    resetStack(vm);
+    vm->regChunk = NULL;
+    vm->params = NULL;
+    vm->profile = NULL;
+    vm->optimizer = NULL;
+    vm->jitThreshold = 0;
+    vm->aot = NULL;
+    vm->trace = NULL;
+    vm->disassembly = NULL;
+    vm->result = NIL_VAL;
+    vm->printResult = true;
+    initArena(&vm->arena, &heapAllocator, ARENA_BLOCK_SIZE);
+    vm->allocator = &vm->arena.allocator;
+#ifdef PROFILE_OPCODE_PAIRS
+    vm->opcodePairs = calloc(UINT8_MAX + 1, sizeof(*vm->opcodePairs));
+    vm->previousOpcode = -1;
+#endif
+}
 
+void freeVM(VM* vm) {
+    FREE_ARRAY(&heapAllocator, MEMORY_VM, Value, vm->stack, vm->stackCapacity);
+    freeArena(&vm->arena);
+#ifdef PROFILE_OPCODE_PAIRS
+    printOpcodePairs(vm);
+    free(vm->opcodePairs);
 #endif
-    for(;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for(Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
+}
+
+/**
+ * Prints the value stack and the instruction about to run to the VM's trace stream.
+ * @param vm the VM being traced
+ * @param ip the instruction about to run
+ * @param stackTop the top of the value stack
+ */
+static void traceInstruction(VM* vm, uint8_t* ip, Value* stackTop) {
+    fprintf(vm->trace, "          ");
+    for(Value* slot = vm->stack; slot < stackTop; slot++) {
+        fprintf(vm->trace, "[ ");
+        fprintValue(vm->trace, *slot);
+        fprintf(vm->trace, " ]");
+    }
+    fprintf(vm->trace, "\n");
+    disassembleInstruction(vm->trace, vm->chunk, (int)(ip - vm->chunk->code));
+}
+
+/**
+ * Prints the registers and the instruction about to run to the VM's trace stream.
+ * @param vm the VM being traced
+ * @param registers the register file
+ * @param ip the instruction about to run
+ */
+static void traceRegisterInstruction(VM* vm, Value* registers, uint32_t* ip) {
+    fprintf(vm->trace, "          ");
+    for(int reg = 0; reg < vm->regChunk->registerCount; reg++) {
+        fprintf(vm->trace, "[ ");
+        fprintValue(vm->trace, registers[reg]);
+        fprintf(vm->trace, " ]");
+    }
+    fprintf(vm->trace, "\n");
+    disassembleRegInstruction(vm->trace, vm->regChunk, (int)(ip - vm->regChunk->code));
+}
+
+// Every loop is instantiated once plain and once per kind of instrumentation. interpretChunk picks
+// the variant once per run, so the plain loops never test whether tracing or profiling is on.
+#define RUN_FUNCTION run
+#define TRACE_INSTRUCTION() do { } while (false)
+#define PROFILE_INSTRUCTION() do { } while (false)
+#define PROFILE_RETURN() do { } while (false)
+#include "run.h"
+
+#define RUN_FUNCTION runTraced
+#define TRACE_INSTRUCTION() traceInstruction(vm, ip, stackTop)
+#define PROFILE_INSTRUCTION() do { } while (false)
+#define PROFILE_RETURN() do { } while (false)
+#include "run.h"
+
+#define RUN_FUNCTION runProfiled
+#define TRACE_INSTRUCTION() do { } while (false)
+#define PROFILE_INSTRUCTION() \
+    profileInstruction(vm->profile, vm->chunk, (int)(ip - vm->chunk->code))
+// Stop the clock before printing, so that the I/O is not charged to OP_RETURN.
+#define PROFILE_RETURN() endProfileRun(vm->profile)
+#include "run.h"
+
+#define RUN_FUNCTION runRegisters
+#define TRACE_INSTRUCTION() do { } while (false)
+#include "runregisters.h"
+
+#define RUN_FUNCTION runRegistersTraced
+#define TRACE_INSTRUCTION() traceRegisterInstruction(vm, registers, ip)
+#include "runregisters.h"
+
+/**
+ * Runs a chunk as machine code once it has run often enough to be worth compiling. A chunk the JIT
+ * cannot translate, or a run without the parameters the code reads, goes to run() instead, which
+ * also reports the error. Hotness is counted per chunk, so it only builds up for callers which keep
+ * their chunk and run it again through interpretChunk().
+ * @param vm the VM, set up to run the chunk
+ * @param chunk the chunk to run
+ * @return the result of running the chunk
+ */
+static InterpretResult runNative(VM* vm, Chunk* chunk) {
+    if(chunk->native == NULL) {
+        if(++chunk->runs < vm->jitThreshold) return run(vm);
+        chunk->native = compileNative(chunk);
+    }
+    NativeCode* native = chunk->native;
+    if(native->function == NULL || (native->usesParams && vm->params == NULL)) return run(vm);
+
+    // The stack has a Value, which is at least as big as a double, for every slot the code spills.
+    vm->result = NUMBER_VAL(native->function(vm->params, (double*)vm->stack));
+    if(vm->printResult) {
+        printValue(vm->result);
         printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-#endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT : {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NEGATE: {
-                push(-pop());
-                break;
-            }
-            case OP_RETURN: {
-                printValue(pop());
-                printf("\n");
-                return INTERPRET_OK;
-            }
-            case OP_ADD:
-                BINARY_OP(+); break;
-            case OP_SUBTRACT:
-                BINARY_OP(-); break;
-            case OP_MULTIPLY:
-                BINARY_OP(*); break;
-            case OP_DIVIDE:
-                BINARY_OP(/); break;
+    }
+    return INTERPRET_OK;
+}
 
-        }
+/**
+ * Runs an already compiled chunk on the chosen backend.
+ * @param chunk the chunk to run
+ * @param backend whether to run the stack bytecode directly or translate it to register code first
+ * @return the result of running the chunk
+ */
+InterpretResult interpretChunk(VM* vm, Chunk* chunk, Backend backend) {
+    vm->chunk = chunk;
+    vm->ip = vm->chunk->code;
+    reserveStack(vm, chunk->maxStack);
+    // Values kept for OP_GET_LOCAL are left below the result, so start each run from the bottom.
+    resetStack(vm);
+
+    if(vm->disassembly != NULL) disassembleChunk(vm->disassembly, chunk, "code");
+
+    if(backend != BACKEND_REGISTER) {
+        if(vm->trace != NULL) return runTraced(vm);
+        if(vm->profile == NULL) return vm->jitThreshold > 0 ? runNative(vm, chunk) : run(vm);
+
+        beginProfileRun(vm->profile, chunk);
+        InterpretResult result = runProfiled(vm);
+        endProfileRun(vm->profile);
+        return result;
+    }
+
+    InterpretResult result;
+    RegChunk regChunk;
+    initRegChunk(&regChunk, &chunk->constants);
+    if(compileRegisters(chunk, &regChunk)) {
+        if(vm->disassembly != NULL) disassembleRegChunk(vm->disassembly, &regChunk, "registers");
+        reserveStack(vm, regChunk.registerCount);
+        vm->regChunk = &regChunk;
+        result = vm->trace != NULL ? runRegistersTraced(vm) : runRegisters(vm);
+        vm->regChunk = NULL;
+    } else {
+        result = INTERPREET_COMPILE_ERROR;
     }
-#undef READ_BYTE
-#undef READ_CONSTANT
-#undef BINARY_OP
+    freeRegChunk(&regChunk);
+    return result;
 }
 
-InterpretResult interpret(const char* source) {
-    Chunk chunk;
-    initChunk(&chunk);
+/**
+ * Runs source text through the function an AOT library has for it, which gives the same result as
+ * compiling and running it. Sources the library does not have, a run without the parameters the
+ * function reads, and runs which trace or profile are left to the VM.
+ * @param vm the VM with the library
+ * @param source the NUL terminated source text
+ * @return true if the library ran the source
+ */
+static bool runCompiled(VM* vm, const char* source) {
+    if(vm->trace != NULL || vm->disassembly != NULL || vm->profile != NULL) return false;
+    const AotEntry* entry = findExpression(vm->aot, source, strlen(source));
+    if(entry == NULL || (entry->usesParams && vm->params == NULL)) return false;
 
-    if(!compile(source, &chunk)) {
-        freeChunk(&chunk);
-        return INTERPREET_COMPILE_ERROR;
+    vm->result = NUMBER_VAL(entry->function(vm->params));
+    if(vm->printResult) {
+        printValue(vm->result);
+        printf("\n");
     }
+    return true;
+}
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+/**
+ * Compiles and runs source text. The chunk and everything else the run allocates comes from the
+ * VM's allocator, and the VM's arena is reset afterwards, so a VM that interprets many small
+ * expressions reuses the same block of memory for each of them.
+ * @param source the NUL terminated source text
+ * @param backend the backend to run the compiled chunk on
+ * @return the result of compiling and running the source
+ */
+InterpretResult interpret(VM* vm, const char* source, Backend backend) {
+    if(vm->aot != NULL && runCompiled(vm, source)) return INTERPRET_OK;
 
-    InterpretResult result = run();
+    Chunk chunk;
+    initChunkWithAllocator(&chunk, vm->allocator);
+
+    InterpretResult result = INTERPREET_COMPILE_ERROR;
+    if(compile(source, strlen(source), &chunk)) {
+        if(vm->optimizer != NULL) optimizeChunk(&chunk, vm->optimizer);
+        result = interpretChunk(vm, &chunk, backend);
+    }
 
     freeChunk(&chunk);
+    resetArena(&vm->arena);
     return result;
 }
\ No newline at end of file
@@ -1,16 +1,44 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include "aot.h"
 #include "chunk.h"
+#include "optimizer.h"
+#include "profile.h"
+#include "regchunk.h"
 #include "value.h"
 
-#define STACK_MAX 256
-
 typedef struct {
     Chunk* chunk;
     uint8_t* ip;
-    Value stack[STACK_MAX];
+    // Grown before each run to what the chunk needs, the run loops never check it themselves.
+    Value* stack;
+    int stackCapacity;
     Value* stackTop;
+    RegChunk* regChunk;
+    uint32_t* regIp;
+    const double* params;
+    Profile* profile;
+    // When set, interpret() runs the peephole passes over what it compiles and counts here.
+    OptimizerStats* optimizer;
+    // A chunk is compiled to machine code on its jitThreshold-th run on the stack backend. 0 leaves
+    // every chunk to the interpreter. Runs are counted on the chunk, and interpret() compiles a fresh
+    // chunk every call, so a threshold above 1 only ever fires for chunks run again through
+    // interpretChunk().
+    int jitThreshold;
+    // When set, interpret() calls the library's compiled function for any source it has one for.
+    AotLibrary* aot;
+    FILE* trace;
+    FILE* disassembly;
+    Value result;
+    bool printResult;
+    // interpret() compiles into this allocator. It is the VM's own arena unless replaced.
+    Allocator* allocator;
+    Arena arena;
+#ifdef PROFILE_OPCODE_PAIRS
+    uint64_t (*opcodePairs)[UINT8_MAX + 1];
+    int previousOpcode;
+#endif
 } VM;
 
 typedef enum {
@@ -19,11 +47,15 @@ typedef enum {
     INTERPREET_RUNTIME_ERROR
 } InterpretResult;
 
-void initVM();
-void freeVM();
-void push(Value value);
-Value pop();
+typedef enum {
+    BACKEND_STACK,
+    BACKEND_REGISTER
+} Backend;
+
+void initVM(VM* vm);
+void freeVM(VM* vm);
 
-InterpretResult interpret(const char* source);
+InterpretResult interpretChunk(VM* vm, Chunk* chunk, Backend backend);
+InterpretResult interpret(VM* vm, const char* source, Backend backend);
 
 #endif //CLOX_VM_H